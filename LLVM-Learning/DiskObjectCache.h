@@ -0,0 +1,121 @@
+//===- DiskObjectCache.h - Persistent cache of JIT'd objects ----*- C++ -*-===//
+//
+// Object files produced by the JIT, stored in a local directory and keyed by a
+// hash of the module's unoptimized IR, the target (triple, CPU and features)
+// and a caller-supplied salt describing the optimization pipeline. A hit lets
+// the JIT skip both the optimizer and the backend.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_DISKOBJECTCACHE_H
+#define KALEIDOSCOPE_DISKOBJECTCACHE_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class DiskObjectCache {
+  std::string Dir;
+  std::string Salt;
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+
+  DiskObjectCache(std::string Dir, std::string Salt)
+      : Dir(std::move(Dir)), Salt(std::move(Salt)) {}
+
+  std::string getPath(StringRef Key) const {
+    SmallString<256> Path(Dir);
+    sys::path::append(Path, Key + ".o");
+    return std::string(Path);
+  }
+
+public:
+  static Expected<std::unique_ptr<DiskObjectCache>> Create(StringRef Dir,
+                                                           StringRef Salt) {
+    if (auto EC = sys::fs::create_directories(Dir))
+      return createFileError(Dir, EC);
+    return std::unique_ptr<DiskObjectCache>(
+        new DiskObjectCache(Dir.str(), Salt.str()));
+  }
+
+  /// Hash the parts of the module that determine the generated code. The
+  /// module identifier is left out, since it differs between runs for the
+  /// same source in lazy mode. Printed IR only refers to debug metadata by
+  /// number, so the source locations are added separately.
+  std::string getKey(const Module &M, StringRef TargetID) const {
+    std::string IR;
+    raw_string_ostream OS(IR);
+    OS << TargetID << '\n' << Salt << '\n' << M.getDataLayoutStr() << '\n';
+    for (auto &G : M.globals())
+      G.print(OS);
+    for (auto &F : M) {
+      F.print(OS);
+      if (auto *SP = F.getSubprogram()) {
+        OS << SP->getDirectory() << '/' << SP->getFilename() << ':'
+           << SP->getLine();
+        for (auto &I : instructions(F))
+          if (const DebugLoc &Loc = I.getDebugLoc())
+            OS << ' ' << Loc.getLine() << ':' << Loc.getCol();
+        OS << '\n';
+      }
+    }
+
+    SHA1 Hasher;
+    Hasher.update(OS.str());
+    return toHex(Hasher.final(), /*LowerCase=*/true);
+  }
+
+  /// Return the cached object for Key, or null on a miss.
+  std::unique_ptr<MemoryBuffer> load(StringRef Key) {
+    auto Obj = MemoryBuffer::getFile(getPath(Key), /*IsText=*/false,
+                                     /*RequiresNullTerminator=*/false);
+    if (!Obj) {
+      ++Misses;
+      return nullptr;
+    }
+    ++Hits;
+    return std::move(*Obj);
+  }
+
+  /// Write Obj under Key. The object goes to a temporary file first and is
+  /// renamed into place, so concurrent writers never expose a partial file.
+  void store(StringRef Key, MemoryBufferRef Obj) {
+    int FD;
+    SmallString<256> TmpPath;
+    if (sys::fs::createUniqueFile(getPath(Key) + ".%%%%%%.tmp", FD, TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+      if (OS.has_error()) {
+        OS.clear_error();
+        sys::fs::remove(TmpPath);
+        return;
+      }
+    }
+    if (sys::fs::rename(TmpPath, getPath(Key)))
+      sys::fs::remove(TmpPath);
+  }
+
+  unsigned getHits() const { return Hits; }
+  unsigned getMisses() const { return Misses; }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_DISKOBJECTCACHE_H
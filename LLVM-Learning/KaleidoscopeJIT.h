@@ -0,0 +1,477 @@
+//===- KaleidoscopeJIT.h - A simple JIT for Kaleidoscope --------*- C++ -*-===//
+//
+// Based on the KaleidoscopeJIT shipped with the LLVM examples. On top of the
+// eager IR -> object pipeline it can run in lazy mode, where definitions are
+// only given call-through stubs when added and each function body is compiled
+// the first time it is called, and it can hand optimization and code generation
+// to a pool of compile threads. Compiled objects can be kept in a persistent
+// DiskObjectCache, and the bytes of emitted code and data are tallied. With
+// hot-swapping enabled, functions are called through indirection stubs that
+// are repointed when a function is redefined. Profilers and debuggers can be
+// told about the objects it loads and frees through JITEventListeners.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
+
+#include "DiskObjectCache.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
+#include <memory>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/mman.h>
+#endif
+
+namespace llvm {
+namespace orc {
+
+/// IRCompiler for the JIT. Consults the object cache, then runs the optimizer
+/// and the backend. The cache key is taken before optimization, so a hit skips
+/// both. Safe to call from several compile threads at once.
+class CachingCompiler : public IRCompileLayer::IRCompiler {
+public:
+  using OptimizeFunction = unique_function<void(Module &, TargetMachine *)>;
+
+  CachingCompiler(JITTargetMachineBuilder JTMB)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(std::move(JTMB)) {
+    TargetID = (this->JTMB.getTargetTriple().str() + "/" +
+                this->JTMB.getCPU() + "/" +
+                this->JTMB.getFeatures().getString());
+  }
+
+  void setOptimizer(OptimizeFunction Optimize) {
+    this->Optimize = std::move(Optimize);
+  }
+
+  void setObjectCache(std::unique_ptr<DiskObjectCache> Cache) {
+    this->Cache = std::move(Cache);
+  }
+
+  DiskObjectCache *getObjectCache() const { return Cache.get(); }
+
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return JTMB.createTargetMachine();
+  }
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    std::string Key;
+    if (Cache) {
+      Key = Cache->getKey(M, TargetID);
+      if (auto Obj = Cache->load(Key))
+        return Obj;
+    }
+
+    // A TargetMachine per compile, as in ConcurrentIRCompiler.
+    auto TM = createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    if (Optimize)
+      Optimize(M, TM->get());
+
+    auto Obj = SimpleCompiler(**TM)(M);
+    if (Obj && Cache)
+      Cache->store(Key, (*Obj)->getMemBufferRef());
+    return Obj;
+  }
+
+private:
+  JITTargetMachineBuilder JTMB;
+  std::string TargetID;
+  OptimizeFunction Optimize;
+  std::unique_ptr<DiskObjectCache> Cache;
+};
+
+/// SectionMemoryManager that tallies the bytes it hands out, so the JIT can
+/// report how much code and data it has emitted.
+class CountingMemoryManager : public SectionMemoryManager {
+  std::atomic<uint64_t> &CodeBytes;
+  std::atomic<uint64_t> &DataBytes;
+
+public:
+  CountingMemoryManager(std::atomic<uint64_t> &CodeBytes,
+                        std::atomic<uint64_t> &DataBytes,
+                        MemoryMapper *MM = nullptr)
+      : SectionMemoryManager(MM), CodeBytes(CodeBytes), DataBytes(DataBytes) {}
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    CodeBytes += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    DataBytes += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+};
+
+/// MemoryMapper that never gives an address range back. Released blocks are
+/// replaced by an inaccessible reservation, which frees their pages but keeps
+/// later objects from being loaded at an address that a profiler has already
+/// seen under another name. Elsewhere than on Unix blocks are released as
+/// usual.
+class ReservingMemoryMapper : public SectionMemoryManager::MemoryMapper {
+public:
+  sys::MemoryBlock
+  allocateMappedMemory(SectionMemoryManager::AllocationPurpose,
+                       size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                       unsigned Flags, std::error_code &EC) override {
+    return sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+  }
+
+  std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+#ifdef LLVM_ON_UNIX
+    if (mmap(M.base(), M.allocatedSize(), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      return std::error_code(errno, std::generic_category());
+    M = sys::MemoryBlock();
+    return std::error_code();
+#else
+    return sys::Memory::releaseMappedMemory(M);
+#endif
+  }
+};
+
+class KaleidoscopeJIT {
+private:
+  std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
+
+  DataLayout DL;
+  MangleAndInterner Mangle;
+
+  std::atomic<uint64_t> CodeBytes{0};
+  std::atomic<uint64_t> DataBytes{0};
+  // Only set once reserveFreedCode() has been called
+  std::unique_ptr<ReservingMemoryMapper> Mapper;
+
+  RTDyldObjectLinkingLayer ObjectLayer;
+  CachingCompiler *Compiler; // Owned by CompileLayer
+  IRCompileLayer CompileLayer;
+  std::unique_ptr<CompileOnDemandLayer> CODLayer; // Only set in lazy mode
+
+  JITDylib &MainJD;
+
+  std::unique_ptr<ThreadPool> CompileThreads; // Only set with compile threads
+
+  // Only set with hot-swapping. Each swappable function's public symbol is a
+  // stub pointing at its current body, which has its own tracker.
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  StringMap<ResourceTrackerSP> SwappableBodies;
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
+  /// Create Name's exported stub, pointing nowhere until it gets a body.
+  Error defineStub(StringRef Name) {
+    assert(Stubs && "Hot-swapping is not enabled");
+    if (Stubs->findStub(Name, /*ExportedStubsOnly=*/true))
+      return Error::success();
+    if (auto Err = Stubs->createStub(Name, 0, JITSymbolFlags::Exported))
+      return Err;
+    auto Stub = Stubs->findStub(Name, /*ExportedStubsOnly=*/true);
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          JITEvaluatedSymbol(Stub.getAddress(), JITSymbolFlags::Exported |
+                                                    JITSymbolFlags::Callable)}}));
+  }
+
+public:
+  KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
+        ObjectLayer(*this->ES,
+                    [this]() {
+                      return std::make_unique<CountingMemoryManager>(
+                          CodeBytes, DataBytes, Mapper.get());
+                    }),
+        Compiler(new CachingCompiler(JTMB)),
+        CompileLayer(*this->ES, ObjectLayer,
+                     std::unique_ptr<CachingCompiler>(Compiler)),
+        MainJD(this->ES->createBareJITDylib("<main>")) {
+    MainJD.addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            this->DL.getGlobalPrefix())));
+    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    }
+    if (this->EPCIU)
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, CompileLayer, this->EPCIU->getLazyCallThroughManager(),
+          [this] { return this->EPCIU->createIndirectStubsManager(); });
+  }
+
+  ~KaleidoscopeJIT() {
+    wait();
+    if (auto Err = ES->endSession())
+      ES->reportError(std::move(Err));
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
+  }
+
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(bool Lazy = false, unsigned NumCompileThreads = 0) {
+    auto EPC = SelfExecutorProcessControl::Create();
+    if (!EPC)
+      return EPC.takeError();
+
+    auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    if (Lazy) {
+      auto EPCIUOrErr =
+          EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+      if (!EPCIUOrErr)
+        return EPCIUOrErr.takeError();
+      EPCIU = std::move(*EPCIUOrErr);
+      EPCIU->createLazyCallThroughManager(
+          *ES, pointerToJITTargetAddress(&handleLazyCallThroughError));
+      if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+        return Err;
+    }
+
+    // Code runs in this process, so target the host CPU and all of its
+    // features (vector widths included) rather than the triple's baseline
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
+    if (!DL)
+      return DL.takeError();
+
+    auto J = std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(EPCIU),
+                                               std::move(*JTMB), std::move(*DL));
+    if (NumCompileThreads)
+      J->enableCompileThreads(NumCompileThreads);
+    return J;
+  }
+
+  /// Run materialization (optimization, codegen and linking) on a pool of
+  /// worker threads instead of on the thread that triggers it.
+  void enableCompileThreads(unsigned NumThreads) {
+    CompileThreads =
+        std::make_unique<ThreadPool>(hardware_concurrency(NumThreads));
+    ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+      // FIXME: ThreadPool::async only takes copyable functions.
+      CompileThreads->async([UnownedT = T.release()]() {
+        std::unique_ptr<Task> T(UnownedT);
+        T->run();
+      });
+    });
+  }
+
+  /// Call functions added with addSwappableFunction through stubs that can
+  /// be repointed, so they can be redefined while their callers stay as is.
+  void enableHotSwap() {
+    Stubs = createLocalIndirectStubsManagerBuilder(
+        ES->getExecutorProcessControl().getTargetTriple())();
+  }
+
+  bool isHotSwap() const { return Stubs != nullptr; }
+
+  const DataLayout &getDataLayout() const { return DL; }
+
+  JITDylib &getMainJITDylib() { return MainJD; }
+
+  bool isLazy() const { return CODLayer != nullptr; }
+
+  /// Total bytes of code and data sections allocated for JIT'd objects,
+  /// including those since freed by removing their tracker.
+  uint64_t getCodeBytes() const { return CodeBytes; }
+  uint64_t getDataBytes() const { return DataBytes; }
+
+  /// Report every object the JIT loads, and frees, to L, which must outlive
+  /// the JIT. Must be called before the first module is added.
+  void registerJITEventListener(JITEventListener &L) {
+    ObjectLayer.registerJITEventListener(L);
+  }
+
+  /// Never reuse the addresses of freed code (see ReservingMemoryMapper), for
+  /// profilers that can't be told that code went away. Must be called before
+  /// the first module is added.
+  void reserveFreedCode() { Mapper = std::make_unique<ReservingMemoryMapper>(); }
+
+  /// Set the IR optimization applied to each module (or, in lazy mode, each
+  /// extracted function) right before it is compiled. Must be set before the
+  /// first module is added.
+  void setOptimizer(CachingCompiler::OptimizeFunction Optimize) {
+    Compiler->setOptimizer(std::move(Optimize));
+  }
+
+  /// Keep compiled objects in Cache. Must be set before the first module is
+  /// added.
+  void setObjectCache(std::unique_ptr<DiskObjectCache> Cache) {
+    Compiler->setObjectCache(std::move(Cache));
+  }
+
+  DiskObjectCache *getObjectCache() const { return Compiler->getObjectCache(); }
+
+  /// A TargetMachine matching the one used for JIT compiles, for optimizing
+  /// IR on the caller's thread.
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return Compiler->createTargetMachine();
+  }
+
+  /// Add a module to the main JITDylib. In lazy mode only modules under the
+  /// default tracker are compiled on demand: CompileOnDemandLayer defines the
+  /// bodies in a separate implementation dylib that removing a custom tracker
+  /// does not reach, so modules meant to be removed again (one-shot top-level
+  /// expressions) are always compiled eagerly.
+  ///
+  /// Modules defining a function with vector parameters are compiled eagerly
+  /// too: the lazy call-through trampoline only preserves the low 128 bits of
+  /// the vector argument registers.
+  ///
+  /// With compile threads, modules under the default tracker are compiled in
+  /// the background straight away rather than on their first lookup.
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (RT)
+      return CompileLayer.add(RT, std::move(TSM));
+
+    SymbolLookupSet Defs;
+    bool VectorArgs = false;
+    TSM.withModuleDo([&](Module &M) {
+      for (auto &F : M) {
+        if (F.isDeclaration())
+          continue;
+        // Local functions have no symbol of their own to look up
+        if (CompileThreads && !F.hasLocalLinkage())
+          Defs.add(Mangle(F.getName()));
+        for (auto &Arg : F.args())
+          VectorArgs |= Arg.getType()->isVectorTy();
+      }
+    });
+
+    RT = MainJD.getDefaultResourceTracker();
+    if (auto Err = CODLayer && !VectorArgs
+                       ? CODLayer->add(RT, std::move(TSM))
+                       : CompileLayer.add(RT, std::move(TSM)))
+      return Err;
+
+    if (!Defs.empty())
+      compileAsync(std::move(Defs));
+    return Error::success();
+  }
+
+  /// Remove the modules added under RT and free their code. With compile
+  /// threads, the thread that emitted them may still be recording their
+  /// memory under RT after a lookup of their symbols has returned, so let
+  /// in-flight compiles finish first.
+  Error removeModule(ResourceTrackerSP RT) {
+    wait();
+    return RT->remove();
+  }
+
+  /// Wait for the compiles running on compile threads, including those
+  /// started by addModule() and compileAsync() that nothing has looked up.
+  void wait() {
+    if (CompileThreads)
+      CompileThreads->wait();
+  }
+
+  /// Start materializing the given symbols without waiting for them. Errors
+  /// are reported through the session; a later blocking lookup of the same
+  /// symbols will see them as well.
+  void compileAsync(SymbolLookupSet Symbols) {
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+        std::move(Symbols), SymbolState::Ready,
+        [this](Expected<SymbolMap> Result) {
+          if (!Result)
+            ES->reportError(Result.takeError());
+        },
+        NoDependenciesToRegister);
+  }
+
+  /// Compile a module defining the single function ImplName and make Name a
+  /// stub that calls it, as replaceFunctionBody does. The body is compiled
+  /// right away, bypassing lazy mode, since the stub needs its address. The
+  /// stub is defined first, so the body can call itself through it.
+  Error addSwappableFunction(ThreadSafeModule TSM, StringRef Name,
+                             StringRef ImplName) {
+    if (auto Err = defineStub(Name))
+      return Err;
+    auto RT = MainJD.createResourceTracker();
+    if (auto Err = CompileLayer.add(RT, std::move(TSM)))
+      return Err;
+    auto Impl = lookup(ImplName);
+    if (!Impl)
+      return Impl.takeError();
+    return replaceFunctionBody(Name, Impl->getAddress(), std::move(RT));
+  }
+
+  /// Make Name a stub that calls Impl, whose code RT owns. If Name already
+  /// has a body, the stub is repointed (a single pointer store) and the
+  /// previous body's code is freed; callers are not touched. Only call this
+  /// when none of the previous body's code can be running.
+  Error replaceFunctionBody(StringRef Name, JITTargetAddress Impl,
+                            ResourceTrackerSP RT) {
+    if (auto Err = defineStub(Name))
+      return Err;
+    if (auto Err = Stubs->updatePointer(Name, Impl))
+      return Err;
+    auto &Body = SwappableBodies[Name];
+    if (Body)
+      if (auto Err = Body->remove())
+        return Err;
+    Body = std::move(RT);
+    return Error::success();
+  }
+
+  /// Define Name as the address of host data, such as a host array's view.
+  Error defineAbsolute(StringRef Name, const void *Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(Addr),
+                             JITSymbolFlags::Exported)}}));
+  }
+
+  Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    return ES->lookup({&MainJD}, Mangle(Name.str()));
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
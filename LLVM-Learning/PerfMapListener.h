@@ -0,0 +1,83 @@
+//===- PerfMapListener.h - perf map file for JIT'd code ---------*- C++ -*-===//
+//
+// A JITEventListener that appends a line per JIT'd function to
+// /tmp/perf-<pid>.map, the file perf report reads to name samples that land in
+// anonymous executable memory. The format has no way to retire an entry, so
+// the JIT must not load new code where freed code used to be (see
+// KaleidoscopeJIT::reserveFreedCode()).
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_PERFMAPLISTENER_H
+#define KALEIDOSCOPE_PERFMAPLISTENER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class PerfMapListener : public JITEventListener {
+  std::string Path;
+  std::error_code EC;
+  raw_fd_ostream OS;
+  std::mutex Mutex;
+
+  PerfMapListener()
+      : Path("/tmp/perf-" + std::to_string(sys::Process::getProcessId()) +
+             ".map"),
+        OS(Path, EC, sys::fs::OF_Text) {}
+
+public:
+  /// The process's listener, shared by every JIT in it. The map file is
+  /// created on the first call.
+  static Expected<PerfMapListener &> get() {
+    static PerfMapListener Instance;
+    if (Instance.EC)
+      return createFileError(Instance.Path, Instance.EC);
+    return Instance;
+  }
+
+  void notifyObjectLoaded(ObjectKey, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    // Symbols in the debug copy of the object have their load addresses
+    object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &SymAndSize : object::computeSymbolSizes(*DebugObj.getBinary())) {
+      const object::SymbolRef &Sym = SymAndSize.first;
+      auto Type = Sym.getType();
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      if (!Type || !Name || !Addr) {
+        consumeError(Type.takeError());
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function || !SymAndSize.second)
+        continue;
+      OS << format_hex_no_prefix(*Addr, 1) << ' '
+         << format_hex_no_prefix(SymAndSize.second, 1) << ' ' << *Name << '\n';
+    }
+    OS.flush();
+  }
+
+  // Nothing to write: the code's addresses stay reserved, so its entries
+  // can't be mistaken for later code.
+  void notifyFreeingObject(ObjectKey) override {}
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_PERFMAPLISTENER_H
@@ -0,0 +1,4384 @@
+//===- Session.cpp - The Kaleidoscope compiler and JIT session ------------===//
+//
+// Everything a Session does: the lexer, parser and code generator, the
+// interpreter that runs code until it is hot, the JIT driver with its caches
+// and profile-guided recompiles, batch evaluation, and ahead-of-time output.
+// The compiler reaches the session in use through S.
+//
+//===----------------------------------------------------------------------===//
+
+#include "KaleidoscopeJIT.h"
+#include "PerfMapListener.h"
+#include "Session.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::orc;
+
+//===----------------------------------------------------------------------===//
+// Session
+//===----------------------------------------------------------------------===//
+
+static thread_local Session* S = nullptr;
+
+/// SessionScope - Makes a session the current one on this thread while it is
+/// alive.
+class SessionScope {
+    Session* Prev;
+public:
+    explicit SessionScope(Session& Sess) : Prev(S) { S = &Sess; }
+    ~SessionScope() { S = Prev; }
+};
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+enum Token {
+    tok_eof = -1,
+
+    // commands
+    tok_def = -2,
+    tok_extern = -3,
+
+    // primary
+    tok_identifier = -4,
+    tok_number = -5,
+
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+    tok_for = -9,
+    tok_in = -10,
+
+    // var definition
+    tok_var = -11,
+
+    // batch evaluation
+    tok_map = -12,
+
+    // memoized definition
+    tok_pure = -13
+};
+
+// Character classes, matching isspace/isalpha/isalnum in the "C" locale
+enum CharClassBits : uint8_t {
+    CC_Space = 1 << 0,
+    CC_IdentStart = 1 << 1,
+    CC_IdentBody = 1 << 2,
+    CC_Number = 1 << 3, // [0-9.]
+};
+
+struct CharClassTable {
+    uint8_t Bits[256];
+
+    constexpr CharClassTable() : Bits() {
+        for (int C = 0; C < 256; ++C) {
+            bool Alpha = (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z');
+            bool Digit = C >= '0' && C <= '9';
+            if (C == ' ' || (C >= '\t' && C <= '\r'))
+                Bits[C] |= CC_Space;
+            if (Alpha)
+                Bits[C] |= CC_IdentStart;
+            if (Alpha || Digit)
+                Bits[C] |= CC_IdentBody;
+            if (Digit || C == '.')
+                Bits[C] |= CC_Number;
+        }
+    }
+
+    bool is(char C, uint8_t Class) const { return Bits[(unsigned char)C] & Class; }
+};
+
+static constexpr CharClassTable CharClass;
+
+static double parseNumber(StringRef Str) {
+    // Plain integers that fit exactly in a double skip strtod
+    if (Str.size() <= 15 && Str.find('.') == StringRef::npos) {
+        uint64_t V = 0;
+        for (char C : Str)
+            V = V * 10 + (C - '0');
+        return (double)V;
+    }
+    SmallString<32> Buf(Str);
+    return strtod(Buf.c_str(), nullptr);
+}
+
+static int gettok() {
+    SourceReader& Src = S->Src;
+    const char* P = Src.Cur;
+
+    // Skip whitespace and comments, pulling in more input as needed.
+    while (true) {
+        while (P != Src.End && CharClass.is(*P, CC_Space))
+            ++P;
+
+        if (P == Src.End) {
+            if (!Src.refill()) {
+                Src.Cur = Src.End;
+                return tok_eof;
+            }
+            P = Src.Cur;
+            continue;
+        }
+
+        if (*P != '#')
+            break;
+
+        // Is comment - skip to end of line
+        while (P != Src.End && *P != '\n' && *P != '\r')
+            ++P;
+    }
+
+    const char* Start = P;
+
+    // Might be keyword or identifier
+    if (CharClass.is(*P, CC_IdentStart)) {
+        do
+            ++P;
+        while (P != Src.End && CharClass.is(*P, CC_IdentBody));
+        Src.Cur = P;
+        S->IdentifierStr = StringRef(Start, P - Start);
+
+        // Check if keyword
+        if (S->IdentifierStr == "def")
+            return tok_def;
+        if (S->IdentifierStr == "extern")
+            return tok_extern;
+        if (S->IdentifierStr == "if")
+            return tok_if;
+        if (S->IdentifierStr == "then")
+            return tok_then;
+        if (S->IdentifierStr == "else")
+            return tok_else;
+        if (S->IdentifierStr == "for")
+            return tok_for;
+        if (S->IdentifierStr == "in")
+            return tok_in;
+        if (S->IdentifierStr == "var")
+            return tok_var;
+        if (S->IdentifierStr == "map")
+            return tok_map;
+        if (S->IdentifierStr == "pure")
+            return tok_pure;
+
+        // Not a keyword, must be user-defined identifier
+        return tok_identifier;
+    }
+
+    // Is a number - EXTEND to avoid [0-9.]+
+    if (CharClass.is(*P, CC_Number)) {
+        do
+            ++P;
+        while (P != Src.End && CharClass.is(*P, CC_Number));
+        Src.Cur = P;
+        S->NumVal = parseNumber(StringRef(Start, P - Start));
+        return tok_number;
+    }
+
+    // Return current char as its ASCII value
+    Src.Cur = P + 1;
+    return (unsigned char)*P;
+}
+
+//===----------------------------------------------------------------------===//
+// Abstract Syntax Tree (aka Parse Tree)
+//===----------------------------------------------------------------------===//
+
+template <typename T, typename... ArgTs>
+static T* newAST(ArgTs&&... Args) {
+    return new (S->ASTArena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+}
+
+// Values are doubles or fixed-width vectors of doubles, spelled double, vec2,
+// vec4 and vec8, or arrays: views of doubles in host memory. A type is passed
+// around as its lane count, 1 for double and ArrayLanes for array.
+static const unsigned ArrayLanes = ~0u;
+
+static unsigned getLanesForTypeName(StringRef Name) {
+    return StringSwitch<unsigned>(Name)
+        .Case("double", 1)
+        .Case("vec2", 2)
+        .Case("vec4", 4)
+        .Case("vec8", 8)
+        .Default(0);
+}
+
+// Session.h names ExprAST and PrototypeAST, so the tree lives outside the
+// anonymous namespace.
+namespace {
+    class BytecodeBuilder;
+    struct ExprKey;
+}
+class BinaryExprAST;
+
+class ExprAST {
+public:
+    virtual ~ExprAST() = default;
+
+    virtual Value* codegen() = 0;
+    // Append interpreter bytecode; false if the node can't be interpreted
+    virtual bool lower(BytecodeBuilder& B) = 0;
+    // Add the node's structure to an expression cache key
+    virtual void profile(ExprKey& K) const = 0;
+    // Same, for the node as the destination of '='
+    virtual void profileAssign(ExprKey& K) const { profile(K); }
+    // Called on a function's body: the node's value is what the function
+    // returns
+    virtual void markTail() {}
+    // Store Val into the location the node names, for '='. Returns null
+    // (after reporting an error) if the node isn't assignable.
+    virtual Value* codegenAssign(Value* Val);
+    // The node if it is a binary operator. Operator trees can be millions of
+    // nodes deep, so BinaryExprAST walks them with an explicit stack instead
+    // of recursing into its operands.
+    virtual const BinaryExprAST* asBinary() const { return nullptr; }
+};
+
+class NumberExprAST : public ExprAST {
+    double Val;
+public:
+    NumberExprAST(double Val) : Val(Val) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+};
+
+class VariableExprAST : public ExprAST {
+    SymbolID Name;
+public:
+    VariableExprAST(SymbolID Name) : Name(Name) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    Value* codegenAssign(Value* Val) override;
+};
+
+// Vector lane or array element access, Base[Index]. A lane index must
+// fold to a constant.
+class IndexExprAST : public ExprAST {
+    ExprAST *Base, *Index;
+public:
+    IndexExprAST(ExprAST* Base, ExprAST* Index) : Base(Base), Index(Index) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    void profileAssign(ExprKey& K) const override;
+    Value* codegenAssign(Value* Val) override;
+};
+
+class BinaryExprAST : public ExprAST {
+    char Op;
+    ExprAST *LHS, *RHS;
+public:
+    BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS)
+        : Op(Op), LHS(LHS), RHS(RHS) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    // Sequencing evaluates to its right operand
+    void markTail() override {
+        if (Op == ':')
+            RHS->markTail();
+    }
+    const BinaryExprAST* asBinary() const override { return this; }
+private:
+    // Apply Op to the operands' values
+    Value* codegenOp(Value* L, Value* R) const;
+};
+
+// Function Calling
+class CallExprAST : public ExprAST {
+    SymbolID Callee; // Function Name
+    ArrayRef<ExprAST*> Args; // Arena-allocated. Arg types not stored since every Value is assumed to be a DP FP number 
+    bool IsTail = false; // Its result is the caller's result
+public:
+    CallExprAST(SymbolID Callee, ArrayRef<ExprAST*> Args)
+        : Callee(Callee), Args(Args) {}
+
+    // Not calling Function* here because a call expression produces a value and not a functions
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    void markTail() override { IsTail = true; }
+};
+
+// if/then/else; the condition is true when it is not 0.0
+class IfExprAST : public ExprAST {
+    ExprAST *Cond, *Then, *Else;
+public:
+    IfExprAST(ExprAST* Cond, ExprAST* Then, ExprAST* Else)
+        : Cond(Cond), Then(Then), Else(Else) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    void markTail() override {
+        Then->markTail();
+        Else->markTail();
+    }
+};
+
+// for VarName = Start, End, Step in Body. End is tested before each
+// iteration; Step is null when omitted. Always evaluates to 0.0.
+class ForExprAST : public ExprAST {
+    SymbolID VarName;
+    ExprAST *Start, *End, *Step, *Body;
+public:
+    ForExprAST(SymbolID VarName, ExprAST* Start, ExprAST* End, ExprAST* Step,
+        ExprAST* Body)
+        : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+};
+
+// var a = 1, b in Body. Each initializer is null when omitted (0.0).
+class VarExprAST : public ExprAST {
+    ArrayRef<std::pair<SymbolID, ExprAST*>> Vars; // Arena-allocated
+    ExprAST* Body;
+public:
+    VarExprAST(ArrayRef<std::pair<SymbolID, ExprAST*>> Vars, ExprAST* Body)
+        : Vars(Vars), Body(Body) {}
+
+    Value* codegen() override;
+    bool lower(BytecodeBuilder& B) override;
+    void profile(ExprKey& K) const override;
+    void markTail() override { Body->markTail(); }
+};
+
+// Function Declaration. Prototypes outlive the arena (they are kept in
+// FunctionProtos), so they are ordinary heap objects.
+class PrototypeAST {
+    SymbolID Name;
+    std::vector<SymbolID> Args;
+    std::vector<unsigned> ArgLanes; // Parallel to Args; see getValueType()
+    unsigned RetLanes;
+public:
+    PrototypeAST(SymbolID Name, std::vector<SymbolID> Args,
+        std::vector<unsigned> ArgLanes = {}, unsigned RetLanes = 1)
+        : Name(Name), Args(std::move(Args)), ArgLanes(std::move(ArgLanes)),
+          RetLanes(RetLanes) {
+        if (this->ArgLanes.empty())
+            this->ArgLanes.assign(this->Args.size(), 1);
+    }
+
+    Function* codegen();
+    SymbolID getSymbol() const { return Name; }
+    StringRef getName() const { return S->Interner.getName(Name); }
+    ArrayRef<SymbolID> getArgs() const { return Args; }
+    // True if every argument and the result are plain doubles
+    bool isScalar() const {
+        return RetLanes == 1 && all_of(ArgLanes, [](unsigned L) { return L == 1; });
+    }
+    bool hasSameType(const PrototypeAST& Other) const {
+        return ArgLanes == Other.ArgLanes && RetLanes == Other.RetLanes;
+    }
+};
+
+// Function Definition
+class FunctionAST {
+    std::unique_ptr<PrototypeAST> Proto; // Null once codegen() has run
+    SymbolID Name;
+    ExprAST* Body;
+    unsigned Line; // Where it starts, with -g
+public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST* Body,
+        unsigned Line = 0)
+        : Proto(std::move(Proto)), Name(this->Proto->getSymbol()), Body(Body),
+          Line(Line) {}
+
+    SymbolID getSymbol() const { return Name; }
+    const PrototypeAST* getProto() const { return Proto.get(); }
+    
+    Function* codegen();
+    // Fill F with bytecode for the body; false if it can't be interpreted
+    bool lower(TieredFunction& F);
+    void profile(ExprKey& K) const { Body->profile(K); }
+};
+
+//===----------------------------------------------------------------------===//
+// Instrumentation
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool> PhaseStats("phase-stats",
+    cl::desc("Print wall time and counts for each compiler phase at exit"));
+
+static cl::opt<std::string> PhaseStatsJSON("phase-stats-json",
+    cl::desc("Write phase statistics, including a record per top-level item, "
+             "to this JSON file at exit"),
+    cl::value_desc("filename"));
+
+enum Phase {
+    PH_Lex,       // gettok()
+    PH_Parse,     // Parse* excluding the lexing they trigger
+    PH_Codegen,   // AST -> IR
+    PH_Optimize,  // OptimizeModule, on whichever thread runs it
+    PH_AddModule, // TheJIT->addModule
+    PH_Lookup,    // TheJIT->lookup, including any compile it waits for
+    PH_Execute,   // Running a top-level expression
+    NumPhases
+};
+
+static const char* PhaseNames[NumPhases] = {
+    "lex", "parse", "codegen", "optimize", "addModule", "lookup", "execute" };
+
+// Atomic since optimization can run on compile threads; lexing is per token,
+// so each thread counts it in plain counters and folds them in later.
+struct PhaseTotals {
+    std::atomic<uint64_t> Count{ 0 }, Nanos{ 0 }, MaxNanos{ 0 };
+};
+static thread_local uint64_t LexCount = 0, LexNanos = 0, LexMaxNanos = 0;
+
+// Per top-level item record, only kept for the JSON file. Items are handled
+// on their session's thread, which tracks the current one.
+struct ItemStats {
+    char Kind; // 'd'ef, 'e'xtern or top-level e'x'pression
+    std::string Name; // Empty if the item failed to parse
+    uint64_t Nanos[NumPhases];
+};
+static thread_local ItemStats CurItem;
+static thread_local bool InItem = false;
+
+/// SessionStats - A session's phase totals and item records. Everything below
+/// is a no-op for a session without them.
+struct SessionStats {
+    PhaseTotals Totals[NumPhases];
+    std::vector<ItemStats> ItemLog;
+    unsigned ItemCounts[3] = {}; // defs, externs, expressions
+};
+
+static uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void AddToPhaseTotal(SessionStats& Stats, Phase P, uint64_t Count,
+    uint64_t Nanos, uint64_t MaxNanos) {
+    auto& T = Stats.Totals[P];
+    T.Count.fetch_add(Count, std::memory_order_relaxed);
+    T.Nanos.fetch_add(Nanos, std::memory_order_relaxed);
+    uint64_t Max = T.MaxNanos.load(std::memory_order_relaxed);
+    while (MaxNanos > Max && !T.MaxNanos.compare_exchange_weak(Max, MaxNanos,
+        std::memory_order_relaxed)) {
+    }
+}
+
+static void RecordPhase(SessionStats& Stats, Phase P, uint64_t Nanos,
+    bool ForCurrentItem) {
+    AddToPhaseTotal(Stats, P, 1, Nanos, Nanos);
+    if (ForCurrentItem && InItem)
+        CurItem.Nanos[P] += Nanos;
+}
+
+// Fold this thread's lex counters into the current session's totals.
+static void FoldLexTotals() {
+    if (S->Stats)
+        AddToPhaseTotal(*S->Stats, PH_Lex, LexCount, LexNanos, LexMaxNanos);
+    LexCount = LexNanos = LexMaxNanos = 0;
+}
+
+/// PhaseTimer - Adds the time it is alive to a phase. ForCurrentItem must be
+/// false off the session's thread or when the work is not tied to one item.
+class PhaseTimer {
+    SessionStats* Stats;
+    Phase P;
+    bool ForCurrentItem;
+    uint64_t Start;
+public:
+    PhaseTimer(Phase P, bool ForCurrentItem = true)
+        : Stats(S->Stats.get()), P(P), ForCurrentItem(ForCurrentItem),
+          Start(Stats ? NowNanos() : 0) {}
+    ~PhaseTimer() {
+        if (Stats)
+            RecordPhase(*Stats, P, NowNanos() - Start, ForCurrentItem);
+    }
+};
+
+template <typename FnT>
+static auto TimePhase(Phase P, FnT Fn) -> decltype(Fn()) {
+    PhaseTimer Timer(P);
+    return Fn();
+}
+
+// Time a Parse* call, less the lexing it does, which is counted under "lex".
+template <typename FnT>
+static auto TimeParse(FnT Parse) -> decltype(Parse()) {
+    if (!S->Stats)
+        return Parse();
+    uint64_t Start = NowNanos(), LexBefore = LexNanos;
+    auto Result = Parse();
+    RecordPhase(*S->Stats, PH_Parse, NowNanos() - Start - (LexNanos - LexBefore), true);
+    return Result;
+}
+
+static int TimedGettok() {
+    uint64_t Start = NowNanos();
+    int Tok = gettok();
+    uint64_t Nanos = NowNanos() - Start;
+    ++LexCount;
+    LexNanos += Nanos;
+    LexMaxNanos = std::max(LexMaxNanos, Nanos);
+    if (InItem)
+        CurItem.Nanos[PH_Lex] += Nanos;
+    return Tok;
+}
+
+static void BeginItem(char Kind) {
+    if (!S->Stats)
+        return;
+    CurItem = ItemStats();
+    CurItem.Kind = Kind;
+    InItem = true;
+}
+
+static void NoteItemName(SymbolID Name) {
+    if (InItem)
+        CurItem.Name = S->Interner.getName(Name).str();
+}
+
+static void EndItem() {
+    if (!InItem)
+        return;
+    InItem = false;
+    ++S->Stats->ItemCounts[CurItem.Kind == 'd' ? 0 : CurItem.Kind == 'e' ? 1 : 2];
+    if (!S->Opts.StatsJSON.empty())
+        S->Stats->ItemLog.push_back(std::move(CurItem));
+}
+
+static uint64_t GetPeakRSSBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS PMC;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &PMC, sizeof(PMC)))
+        return 0;
+    return PMC.PeakWorkingSetSize;
+#else
+    struct rusage RU;
+    if (getrusage(RUSAGE_SELF, &RU))
+        return 0;
+#ifdef __APPLE__
+    return RU.ru_maxrss;
+#else
+    return (uint64_t)RU.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+static int getNextToken() {
+    return S->CurTok = S->Stats ? TimedGettok() : gettok();
+}
+
+// Precedence of each binary operator, indexed by its token; 0 for tokens that
+// aren't one
+struct PrecedenceTable {
+    int8_t Prec[128];
+
+    constexpr PrecedenceTable() : Prec() {
+        Prec[':'] = 1;
+        Prec['='] = 2;
+        Prec['<'] = 10;
+        Prec['+'] = 20;
+        Prec['-'] = 20;
+        Prec['*'] = 40;
+    }
+};
+
+static constexpr PrecedenceTable BinopPrecedence;
+
+static int GetTokPrecedence() {
+    // Operator tokens are ASCII values
+    if (!isascii(S->CurTok)) return -1;
+
+    int TokPrec = BinopPrecedence.Prec[S->CurTok];
+    if (TokPrec <= 0)
+        return -1;
+    return TokPrec;
+}
+
+static bool HoldMessage(std::string Message);
+
+ExprAST* LogError(const char* Str) {
+    if (!HoldMessage(("Error: " + Twine(Str) + "\n").str()))
+        fprintf(stderr, "Error: %s\n", Str);
+    ++S->NumErrors;
+    return nullptr;
+}
+
+std::unique_ptr<PrototypeAST> LogErrorP(const char* Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+// Line of the current token, with -g; 0 otherwise
+static unsigned TokLine() {
+    return S->Src.TrackLines ? S->Src.lineAt(S->Src.Cur) : 0;
+}
+
+// Record that Node starts on Line, for the line table
+static ExprAST* AtLine(ExprAST* Node, unsigned Line) {
+    if (Line)
+        S->ExprLines[Node] = Line;
+    return Node;
+}
+
+// Expressions are parsed without recursion, so machine-generated formulas with
+// millions of terms or deeply nested parentheses can't overflow the stack.
+// Operands and pending binary operators wait on explicit stacks, and each
+// construct whose sub-expressions are still being parsed (parentheses, a call,
+// an index, if, for or var) has a frame.
+
+namespace {
+    // What the parser expects next
+    enum ParseStep {
+        PS_Error,   // An error has been reported
+        PS_SubExpr, // The start of a (sub-)expression
+        PS_Operand, // An operand is complete: a postfix, binary operator or end
+    };
+
+    // A binary operator whose right operand is still being parsed
+    struct PendingOp {
+        int Op;
+        int Prec;
+        unsigned Line;
+    };
+
+    struct ParseFrame {
+        enum FrameKind : uint8_t { Paren, Call, Index, If, For, Var } Kind;
+        // Which sub-expression is being parsed: if's condition, then and else;
+        // for's start, end, step and body; var's initializers, then its body
+        uint8_t Part;
+        unsigned Line;
+        // Stack heights when the frame was opened. Operators above OpBase
+        // belong to the sub-expression being parsed, and the operands above
+        // OperandBase are the frame's finished sub-expressions.
+        unsigned OpBase, OperandBase;
+        unsigned VarBase; // This frame's first entry in VarNames
+        SymbolID Name;    // The callee or loop variable
+    };
+
+    struct ParseStacks {
+        SmallVector<ExprAST*, 32> Operands;
+        SmallVector<PendingOp, 16> Ops;
+        SmallVector<ParseFrame, 8> Frames;
+        // The names declared by open var frames, and whether each one has an
+        // initializer
+        SmallVector<std::pair<SymbolID, bool>, 8> VarNames;
+
+        void open(ParseFrame::FrameKind Kind, unsigned Line, SymbolID Name = 0) {
+            Frames.push_back({ Kind, 0, Line, (unsigned)Ops.size(),
+                (unsigned)Operands.size(), (unsigned)VarNames.size(), Name });
+        }
+
+        // The innermost frame's finished sub-expressions
+        ArrayRef<ExprAST*> parts() const {
+            return makeArrayRef(Operands).drop_front(Frames.back().OperandBase);
+        }
+
+        // Replace the innermost frame and its sub-expressions with Node
+        ParseStep close(ExprAST* Node) {
+            Operands.resize(Frames.back().OperandBase);
+            VarNames.resize(Frames.back().VarBase);
+            Frames.pop_back();
+            Operands.push_back(Node);
+            return PS_Operand;
+        }
+    };
+}
+
+static ParseStep LogErrorS(const char* Str) {
+    LogError(Str);
+    return PS_Error;
+}
+
+// Combine the pending operators above Base whose precedence is at least
+// MinPrec into binary nodes. Every operator is left-associative.
+static void ReduceOps(ParseStacks& St, unsigned Base, int MinPrec) {
+    while (St.Ops.size() > Base && St.Ops.back().Prec >= MinPrec) {
+        PendingOp Op = St.Ops.pop_back_val();
+        ExprAST* RHS = St.Operands.pop_back_val();
+        ExprAST*& LHS = St.Operands.back();
+        LHS = AtLine(newAST<BinaryExprAST>(Op.Op, LHS, RHS), Op.Line);
+    }
+}
+
+// Parse var declarations up to the next initializer, or past 'in' to the
+// body. CurTok is the first name or, with Resume, whatever follows a finished
+// declaration.
+static ParseStep ParseVarList(ParseStacks& St, bool Resume) {
+    while (true) {
+        if (Resume) {
+            if (S->CurTok != ',') {
+                if (S->CurTok != tok_in)
+                    return LogErrorS("expected 'in' keyword after 'var'");
+                getNextToken(); // consume 'in'
+                St.Frames.back().Part = 1;
+                return PS_SubExpr;
+            }
+            getNextToken(); // consume ','
+            if (S->CurTok != tok_identifier)
+                return LogErrorS("expected identifier list after var");
+        }
+        Resume = true;
+
+        SymbolID Name = S->Interner.intern(S->IdentifierStr);
+        getNextToken(); // consume identifier
+
+        // The initializer is optional
+        bool HasInit = S->CurTok == '=';
+        St.VarNames.push_back({ Name, HasInit });
+        if (HasInit) {
+            getNextToken(); // consume '='
+            return PS_SubExpr;
+        }
+    }
+}
+
+// The innermost frame's current sub-expression is complete. Move on to its
+// next one, or close the frame and push the node it built.
+static ParseStep FinishSubExpr(ParseStacks& St) {
+    ParseFrame& F = St.Frames.back();
+    ArrayRef<ExprAST*> Parts = St.parts();
+    switch (F.Kind) {
+    case ParseFrame::Paren:
+        if (S->CurTok != ')')
+            return LogErrorS("expected ')'");
+        getNextToken(); // consume ')'
+        return St.close(Parts[0]);
+
+    case ParseFrame::Call: {
+        if (S->CurTok != ')') {
+            if (S->CurTok != ',')
+                return LogErrorS("Expected ')' or ',' in argument list");
+            getNextToken(); // consume ','
+            return PS_SubExpr;
+        }
+        getNextToken(); // consume ')'
+
+        // Move the argument list into the arena alongside the node
+        auto* ArgsMem = S->ASTArena.Allocate<ExprAST*>(Parts.size());
+        std::uninitialized_copy(Parts.begin(), Parts.end(), ArgsMem);
+        return St.close(AtLine(newAST<CallExprAST>(F.Name,
+            makeArrayRef(ArgsMem, Parts.size())), F.Line));
+    }
+
+    case ParseFrame::Index:
+        if (S->CurTok != ']')
+            return LogErrorS("expected ']'");
+        getNextToken(); // consume ']'
+        return St.close(AtLine(newAST<IndexExprAST>(Parts[0], Parts[1]), F.Line));
+
+    case ParseFrame::If:
+        if (F.Part == 0) {
+            if (S->CurTok != tok_then)
+                return LogErrorS("expected then");
+            getNextToken(); // consume 'then'
+            F.Part = 1;
+            return PS_SubExpr;
+        }
+        if (F.Part == 1) {
+            if (S->CurTok != tok_else)
+                return LogErrorS("expected else");
+            getNextToken(); // consume 'else'
+            F.Part = 2;
+            return PS_SubExpr;
+        }
+        return St.close(AtLine(newAST<IfExprAST>(Parts[0], Parts[1], Parts[2]), F.Line));
+
+    case ParseFrame::For:
+        if (F.Part == 0) {
+            if (S->CurTok != ',')
+                return LogErrorS("expected ',' after for start value");
+            getNextToken(); // consume ','
+            F.Part = 1;
+            return PS_SubExpr;
+        }
+        // The step value is optional
+        if (F.Part == 1 && S->CurTok == ',') {
+            getNextToken(); // consume ','
+            F.Part = 2;
+            return PS_SubExpr;
+        }
+        if (F.Part != 3) {
+            if (S->CurTok != tok_in)
+                return LogErrorS("expected 'in' after for");
+            getNextToken(); // consume 'in'
+            F.Part = 3;
+            return PS_SubExpr;
+        }
+        return St.close(AtLine(newAST<ForExprAST>(F.Name, Parts[0], Parts[1],
+            Parts.size() == 4 ? Parts[2] : nullptr, Parts.back()), F.Line));
+
+    case ParseFrame::Var: {
+        if (F.Part == 0)
+            return ParseVarList(St, /*Resume=*/true);
+
+        // Pair each name with its initializer, if it has one
+        auto Names = makeArrayRef(St.VarNames).drop_front(F.VarBase);
+        auto* VarsMem = S->ASTArena.Allocate<std::pair<SymbolID, ExprAST*>>(Names.size());
+        auto Init = Parts.begin();
+        for (size_t i = 0; i != Names.size(); ++i)
+            new (&VarsMem[i]) std::pair<SymbolID, ExprAST*>(Names[i].first,
+                Names[i].second ? *Init++ : nullptr);
+        return St.close(AtLine(newAST<VarExprAST>(makeArrayRef(VarsMem, Names.size()),
+            Parts.back()), F.Line));
+    }
+    }
+    llvm_unreachable("unknown parse frame");
+}
+
+// Parse the start of an operand: push a number or variable, or open a frame
+// for a construct with sub-expressions
+static ParseStep ParseOperand(ParseStacks& St) {
+    // CurTok allows for lookahead
+    switch (S->CurTok) {
+    default:
+        return LogErrorS("unknown token when expecting an expression");
+
+    case tok_number:
+        St.Operands.push_back(newAST<NumberExprAST>(S->NumVal));
+        getNextToken(); // consume number
+        return PS_Operand;
+
+    case tok_identifier: {
+        SymbolID IdName = S->Interner.intern(S->IdentifierStr);
+        unsigned Line = TokLine();
+        getNextToken(); // consume identifier
+
+        // Just a variable and not a call expression
+        if (S->CurTok != '(') {
+            St.Operands.push_back(AtLine(newAST<VariableExprAST>(IdName), Line));
+            return PS_Operand;
+        }
+        getNextToken(); // consume '('
+        St.open(ParseFrame::Call, Line, IdName);
+        if (S->CurTok == ')')
+            return FinishSubExpr(St);
+        return PS_SubExpr;
+    }
+
+    case '(':
+        getNextToken(); // consume '('
+        St.open(ParseFrame::Paren, 0);
+        return PS_SubExpr;
+
+    case tok_if:
+        St.open(ParseFrame::If, TokLine());
+        getNextToken(); // consume 'if'
+        return PS_SubExpr;
+
+    case tok_for: {
+        unsigned Line = TokLine();
+        getNextToken(); // consume 'for'
+
+        if (S->CurTok != tok_identifier)
+            return LogErrorS("expected identifier after for");
+        SymbolID IdName = S->Interner.intern(S->IdentifierStr);
+        getNextToken(); // consume identifier
+
+        if (S->CurTok != '=')
+            return LogErrorS("expected '=' after for");
+        getNextToken(); // consume '='
+        St.open(ParseFrame::For, Line, IdName);
+        return PS_SubExpr;
+    }
+
+    case tok_var: {
+        unsigned Line = TokLine();
+        getNextToken(); // consume 'var'
+
+        if (S->CurTok != tok_identifier)
+            return LogErrorS("expected identifier after var");
+        St.open(ParseFrame::Var, Line);
+        return ParseVarList(St, /*Resume=*/false);
+    }
+    }
+}
+
+// expression ::= postfix (binop postfix)*
+// postfix ::= primary ('[' expression ']')*
+static ExprAST* ParseExpression() {
+    ParseStacks St;
+    ParseStep Step = PS_SubExpr;
+    while (true) {
+        switch (Step) {
+        case PS_Error:
+            return nullptr;
+
+        case PS_SubExpr:
+            Step = ParseOperand(St);
+            break;
+
+        case PS_Operand: {
+            if (S->CurTok == '[') {
+                // The operand just parsed is the indexed value
+                St.open(ParseFrame::Index, TokLine());
+                --St.Frames.back().OperandBase;
+                getNextToken(); // consume '['
+                Step = PS_SubExpr;
+                break;
+            }
+
+            // Operators with a higher precedence than this one, and those of
+            // equal precedence to its left, have both their operands
+            unsigned Base = St.Frames.empty() ? 0 : St.Frames.back().OpBase;
+            int TokPrec = GetTokPrecedence();
+            if (TokPrec > 0) {
+                ReduceOps(St, Base, TokPrec);
+                St.Ops.push_back({ S->CurTok, TokPrec, TokLine() });
+                getNextToken(); // consume the operator
+                Step = PS_SubExpr;
+                break;
+            }
+
+            // Anything else ends the innermost (sub-)expression
+            ReduceOps(St, Base, 0);
+            if (St.Frames.empty())
+                return St.Operands.pop_back_val();
+            Step = FinishSubExpr(St);
+            break;
+        }
+        }
+    }
+}
+
+static bool isBuiltin(StringRef Name);
+struct MathBuiltin;
+static const MathBuiltin* getMathBuiltin(StringRef Name);
+
+// [':' type]. Returns the lane count, 1 when the type is omitted, or 0 after
+// reporting an error.
+static unsigned ParseOptionalType() {
+    if (S->CurTok != ':')
+        return 1;
+    getNextToken(); // consume ':'
+    unsigned Lanes = 0;
+    if (S->CurTok == tok_identifier)
+        Lanes = S->IdentifierStr == "array" ? ArrayLanes
+                                            : getLanesForTypeName(S->IdentifierStr);
+    if (!Lanes) {
+        LogError("Expected double, vec2, vec4, vec8 or array after ':'");
+        return 0;
+    }
+    getNextToken(); // consume type name
+    return Lanes;
+}
+
+static std::unique_ptr<PrototypeAST> ParsePrototype(bool IsExtern = false) {
+    if (S->CurTok != tok_identifier)
+        return LogErrorP("Expected function name in prototype");
+
+    // Math builtins may still be declared as the C functions they are named
+    // after, say to map one; calls use the builtin regardless.
+    if (isBuiltin(S->IdentifierStr) && !(IsExtern && getMathBuiltin(S->IdentifierStr)))
+        return LogErrorP("Builtin functions cannot be redefined");
+    SymbolID FnName = S->Interner.intern(S->IdentifierStr);
+    getNextToken(); // consume identifier
+
+    if (S->CurTok != '(')
+        return LogErrorP("Expected '(' in prototype");
+
+    std::vector<SymbolID> ArgNames;
+    std::vector<unsigned> ArgLanes;
+    getNextToken(); // consume '('
+    while (S->CurTok == tok_identifier) {
+        ArgNames.push_back(S->Interner.intern(S->IdentifierStr));
+        getNextToken(); // consume identifier
+        ArgLanes.push_back(ParseOptionalType());
+        if (!ArgLanes.back())
+            return nullptr;
+    }
+    if (S->CurTok != ')')
+        return LogErrorP("Expected ')' in prototype");
+
+    getNextToken(); // consume ')'
+
+    unsigned RetLanes = ParseOptionalType();
+    if (!RetLanes)
+        return nullptr;
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames),
+        std::move(ArgLanes), RetLanes);
+}
+
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+    unsigned Line = TokLine();
+    getNextToken(); // consume 'def'
+    auto Proto = ParsePrototype();
+    if (!Proto)
+        return nullptr;
+
+    if (auto E = ParseExpression())
+        return std::make_unique<FunctionAST>(std::move(Proto), E, Line);
+    return nullptr;
+}
+
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+    unsigned Line = TokLine();
+    if (auto E = ParseExpression()) {
+        // Make an anonymous proto (no args)
+        auto Proto = std::make_unique<PrototypeAST>(S->Interner.intern("__anon_expr"),
+            std::vector<SymbolID>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E, Line);
+    }
+    return nullptr;
+}
+
+static std::unique_ptr<PrototypeAST> ParseExtern() {
+    getNextToken(); // eat extern
+    return ParsePrototype(/*IsExtern=*/true);
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+static ExitOnError ExitOnErr;
+
+Function* getFunction(SymbolID Name) {
+    
+    // First check if the function has already been added to the current module
+    if (auto* F = S->TheModule->getFunction(S->Interner.getName(Name))) return F;
+
+    // If not, check whether we can codegen the declaration from some existing prototype.
+    auto FI = S->FunctionProtos.find(Name);
+    if (FI != S->FunctionProtos.end())
+        return FI->second->codegen();
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+Value* LogErrorV(const char* Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+// An array is passed by value as { double*, i64 }, which calls split into a
+// pointer and a count argument
+static StructType* getArrayType() {
+    Type* Double = Type::getDoubleTy(*S->TheContext);
+    return StructType::get(PointerType::getUnqual(Double),
+        Type::getInt64Ty(*S->TheContext));
+}
+
+static bool isArray(Value* V) {
+    return V->getType() == getArrayType();
+}
+
+static Type* getValueType(unsigned Lanes) {
+    Type* Double = Type::getDoubleTy(*S->TheContext);
+    if (Lanes == ArrayLanes)
+        return getArrayType();
+    return Lanes == 1 ? Double : FixedVectorType::get(Double, Lanes);
+}
+
+// A math function lowered to an LLVM intrinsic instead of a call to opaque
+// native code, so the optimizer can constant-fold, reorder and vectorize it.
+// Intrinsics without an instruction of their own still end up calling the
+// C library function of the same name.
+struct MathBuiltin {
+    const char* Name;
+    Intrinsic::ID ID;
+    unsigned NumArgs;
+};
+
+static const MathBuiltin MathBuiltins[] = {
+    { "sqrt", Intrinsic::sqrt, 1 },
+    { "sin", Intrinsic::sin, 1 },
+    { "cos", Intrinsic::cos, 1 },
+    { "exp", Intrinsic::exp, 1 },
+    { "exp2", Intrinsic::exp2, 1 },
+    { "log", Intrinsic::log, 1 },
+    { "log2", Intrinsic::log2, 1 },
+    { "log10", Intrinsic::log10, 1 },
+    { "fabs", Intrinsic::fabs, 1 },
+    { "floor", Intrinsic::floor, 1 },
+    { "ceil", Intrinsic::ceil, 1 },
+    { "trunc", Intrinsic::trunc, 1 },
+    { "round", Intrinsic::round, 1 },
+    { "pow", Intrinsic::pow, 2 },
+    { "fmin", Intrinsic::minnum, 2 },
+    { "fmax", Intrinsic::maxnum, 2 },
+    { "copysign", Intrinsic::copysign, 2 },
+    { "fma", Intrinsic::fma, 3 },
+};
+
+static const MathBuiltin* getMathBuiltin(StringRef Name) {
+    for (const MathBuiltin& B : MathBuiltins)
+        if (Name == B.Name)
+            return &B;
+    return nullptr;
+}
+
+// writed(x) writes a double to stdout, writea(a) every double in an array
+// and writeraw(a) an array's bytes as they are. They go through the output
+// buffers of the native runtime below and return 0.
+static bool isOutputBuiltin(StringRef Name) {
+    return Name == "writed" || Name == "writea" || Name == "writeraw";
+}
+
+// vec2, vec4 and vec8 build a vector from one double per lane, or splat a
+// single double. hsum, hmin and hmax reduce a vector to a double. The math
+// builtins work on doubles, or lane by lane on vectors. len(a) is the number
+// of doubles in an array.
+static bool isBuiltin(StringRef Name) {
+    return getLanesForTypeName(Name) > 1 || Name == "hsum" || Name == "hmin" ||
+        Name == "hmax" || getMathBuiltin(Name) || Name == "len" ||
+        isOutputBuiltin(Name);
+}
+
+// Call Math's intrinsic on ArgsV. If any argument is a vector, the doubles
+// among them are splatted to its width.
+static Value* CodegenMathBuiltin(const MathBuiltin& Math, MutableArrayRef<Value*> ArgsV) {
+    if (ArgsV.size() != Math.NumArgs)
+        return LogErrorV("Incorrect # arguments passed");
+    if (any_of(ArgsV, isArray))
+        return LogErrorV("Math builtins take doubles or vectors");
+    Type* Ty = ArgsV[0]->getType();
+    for (Value* V : ArgsV)
+        if (V->getType()->isVectorTy()) {
+            if (Ty->isVectorTy() && Ty != V->getType())
+                return LogErrorV("Vector operands have different widths");
+            Ty = V->getType();
+        }
+    if (auto* VecTy = dyn_cast<FixedVectorType>(Ty))
+        for (Value*& V : ArgsV)
+            if (!V->getType()->isVectorTy())
+                V = S->Builder->CreateVectorSplat(VecTy->getNumElements(), V, "splat");
+    // CreateCall, unlike CreateIntrinsic, applies the builder's fast-math flags
+    Function* Intrinsic = Intrinsic::getDeclaration(S->TheModule.get(), Math.ID, { Ty });
+    return S->Builder->CreateCall(Intrinsic, ArgsV, Math.Name);
+}
+
+// The native function behind an output builtin, taking a double or an array
+// split into its pointer and count
+static FunctionCallee getOutputFunction(StringRef Name) {
+    Type* Double = S->Builder->getDoubleTy();
+    std::vector<Type*> Params = { Double };
+    if (Name != "writed")
+        Params = { PointerType::getUnqual(Double), S->Builder->getInt64Ty() };
+    return S->TheModule->getOrInsertFunction(("kaleidoscope_" + Name).str(),
+        FunctionType::get(Double, Params, false));
+}
+
+static Value* CodegenArrayBuiltin(StringRef Name, Value* Arg) {
+    if (Name == "writed") {
+        if (!Arg->getType()->isDoubleTy())
+            return LogErrorV("writed takes a double");
+        return S->Builder->CreateCall(getOutputFunction(Name), { Arg });
+    }
+    if (!isArray(Arg))
+        return LogErrorV((Name + " takes an array").str().c_str());
+    Value* Size = S->Builder->CreateExtractValue(Arg, 1, "size");
+    if (Name == "len")
+        return S->Builder->CreateUIToFP(Size, S->Builder->getDoubleTy(), "len");
+    return S->Builder->CreateCall(getOutputFunction(Name),
+        { S->Builder->CreateExtractValue(Arg, 0, "data"), Size });
+}
+
+static Value* CodegenBuiltin(StringRef Name, ArrayRef<ExprAST*> Args) {
+    std::vector<Value*> ArgsV;
+    for (auto* Arg : Args) {
+        ArgsV.push_back(Arg->codegen());
+        if (!ArgsV.back())
+            return nullptr;
+    }
+
+    if (auto* Math = getMathBuiltin(Name))
+        return CodegenMathBuiltin(*Math, ArgsV);
+
+    if (unsigned Lanes = getLanesForTypeName(Name)) {
+        if (ArgsV.size() != 1 && ArgsV.size() != Lanes)
+            return LogErrorV("Incorrect # arguments passed");
+        if (any_of(ArgsV, [](Value* V) { return !V->getType()->isDoubleTy(); }))
+            return LogErrorV("Vector lanes must be doubles");
+        if (ArgsV.size() == 1)
+            return S->Builder->CreateVectorSplat(Lanes, ArgsV[0], "splat");
+        Value* Vec = PoisonValue::get(getValueType(Lanes));
+        for (unsigned i = 0; i != Lanes; ++i)
+            Vec = S->Builder->CreateInsertElement(Vec, ArgsV[i], (uint64_t)i, "vec");
+        return Vec;
+    }
+
+    if (ArgsV.size() != 1)
+        return LogErrorV("Incorrect # arguments passed");
+    if (Name == "len" || isOutputBuiltin(Name))
+        return CodegenArrayBuiltin(Name, ArgsV[0]);
+    if (!ArgsV[0]->getType()->isVectorTy())
+        return LogErrorV("Only vectors can be reduced");
+    CallInst* Reduce;
+    if (Name == "hsum")
+        Reduce = S->Builder->CreateFAddReduce(
+            ConstantFP::getNegativeZero(Type::getDoubleTy(*S->TheContext)), ArgsV[0]);
+    else if (Name == "hmin")
+        Reduce = S->Builder->CreateFPMinReduce(ArgsV[0]);
+    else
+        Reduce = S->Builder->CreateFPMaxReduce(ArgsV[0]);
+    // The reduction helpers don't apply the builder's fast-math flags. With
+    // reassoc, hsum may add the lanes in any order.
+    Reduce->setFastMathFlags(S->Builder->getFastMathFlags());
+    return Reduce;
+}
+
+// Create an alloca in the entry block of F, so mem2reg can promote it
+static AllocaInst* CreateEntryBlockAlloca(Function* F, SymbolID Name, Type* Ty) {
+    IRBuilder<> TmpB(&F->getEntryBlock(), F->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, S->Interner.getName(Name));
+}
+
+// The condition of an if or for: a double, true when it is not 0.0
+static Value* CodegenCondition(ExprAST& Cond, const char* Name) {
+    Value* CondV = Cond.codegen();
+    if (!CondV)
+        return nullptr;
+    if (!CondV->getType()->isDoubleTy())
+        return LogErrorV("Condition must be a double");
+    return S->Builder->CreateFCmpONE(
+        CondV, ConstantFP::get(*S->TheContext, APFloat(0.0)), Name);
+}
+
+// Bind Name to Slot until the returned binding is restored
+static AllocaInst* BindVariable(SymbolID Name, AllocaInst* Slot) {
+    AllocaInst*& Binding = S->NamedValues[Name];
+    AllocaInst* Old = Binding;
+    Binding = Slot;
+    return Old;
+}
+
+static void RestoreVariable(SymbolID Name, AllocaInst* Old) {
+    if (Old)
+        S->NamedValues[Name] = Old;
+    else
+        S->NamedValues.erase(Name);
+}
+
+// With -g, attribute the instructions generated from here on to the line E
+// starts on
+static void EmitLocation(const ExprAST* E) {
+    if (!S->CurSubprogram)
+        return;
+    if (unsigned Line = S->ExprLines.lookup(E))
+        S->Builder->SetCurrentDebugLocation(
+            DILocation::get(*S->TheContext, Line, 0, S->CurSubprogram));
+}
+
+Value* NumberExprAST::codegen() {
+    // We use get:: to avoid having different variables point to identical valued constants
+    // More memory efficient to have a single variable and reuse that
+    return ConstantFP::get(*S->TheContext, APFloat(Val));
+}
+
+// The view of the host array Name, or null if there is none. It is loaded
+// once, on entry to the function being generated, so stores through it can't
+// force a reload of the view in every loop iteration.
+static Value* GetHostArray(SymbolID Name) {
+    Value*& View = S->HostArrayViews[Name];
+    if (View)
+        return View;
+    StringRef Str = S->Interner.getName(Name);
+    if (!S->HostArrays.count(Str))
+        return nullptr;
+
+    // The JIT resolves __array.<name> to the view in HostArrays
+    std::string GlobalName = ("__array." + Str).str();
+    GlobalVariable* G = S->TheModule->getNamedGlobal(GlobalName);
+    if (!G)
+        G = new GlobalVariable(*S->TheModule, getArrayType(), /*isConstant=*/false,
+            GlobalValue::ExternalLinkage, nullptr, GlobalName);
+    Function* TheFunction = S->Builder->GetInsertBlock()->getParent();
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    return View = TmpB.CreateLoad(getArrayType(), G, Str);
+}
+
+// Variable Reference
+Value* VariableExprAST::codegen() {
+    EmitLocation(this);
+    // Look this variable up in the function, then among the host's arrays
+    AllocaInst* A = S->NamedValues.lookup(Name);
+    if (!A) {
+        if (Value* View = GetHostArray(Name))
+            return View;
+        return LogErrorV("Unknown variable name");
+    }
+    return S->Builder->CreateLoad(A->getAllocatedType(), A, S->Interner.getName(Name));
+}
+
+Value* ExprAST::codegenAssign(Value*) {
+    return LogErrorV("destination of '=' must be a variable or a lane of one");
+}
+
+Value* VariableExprAST::codegenAssign(Value* Val) {
+    AllocaInst* A = S->NamedValues.lookup(Name);
+    if (!A)
+        return LogErrorV("Unknown variable name");
+    // A variable keeps the type of its initial value
+    if (Val->getType() != A->getAllocatedType())
+        return LogErrorV("Assigned value does not match the variable's type");
+    S->Builder->CreateStore(Val, A);
+    return Val;
+}
+
+// Index as a lane number of Vec, or -1 after reporting an error
+static int GetLaneIndex(Value* Vec, ExprAST& Index) {
+    auto* VecTy = dyn_cast<FixedVectorType>(Vec->getType());
+    if (!VecTy) {
+        LogError("Only vectors can be indexed");
+        return -1;
+    }
+    Value* IndexV = Index.codegen();
+    if (!IndexV)
+        return -1;
+    auto* C = dyn_cast<ConstantFP>(IndexV);
+    double Lane = C ? C->getValueAPF().convertToDouble() : -1;
+    if (Lane < 0 || Lane >= VecTy->getNumElements() || Lane != (int)Lane) {
+        LogError("Lane index must be a constant within the vector");
+        return -1;
+    }
+    return (int)Lane;
+}
+
+// Address of element Index of Array. Indices are truncated to integers and
+// not checked against the array's size.
+static Value* GetElementAddress(Value* Array, ExprAST& Index) {
+    Value* IndexV = Index.codegen();
+    if (!IndexV)
+        return nullptr;
+    if (!IndexV->getType()->isDoubleTy())
+        return LogErrorV("Array index must be a double");
+    Value* Data = S->Builder->CreateExtractValue(Array, 0, "data");
+    return S->Builder->CreateInBoundsGEP(S->Builder->getDoubleTy(), Data,
+        S->Builder->CreateFPToSI(IndexV, S->Builder->getInt64Ty(), "idx"), "elt");
+}
+
+Value* IndexExprAST::codegen() {
+    EmitLocation(this);
+    Value* Vec = Base->codegen();
+    if (!Vec)
+        return nullptr;
+    if (isArray(Vec)) {
+        Value* Ptr = GetElementAddress(Vec, *Index);
+        if (!Ptr)
+            return nullptr;
+        return S->Builder->CreateLoad(S->Builder->getDoubleTy(), Ptr, "elt");
+    }
+    int Lane = GetLaneIndex(Vec, *Index);
+    if (Lane < 0)
+        return nullptr;
+    return S->Builder->CreateExtractElement(Vec, (uint64_t)Lane, "lane");
+}
+
+// v[i] = x replaces one lane of the variable v, a[i] = x stores into the
+// array a
+Value* IndexExprAST::codegenAssign(Value* Val) {
+    if (!Val->getType()->isDoubleTy())
+        return LogErrorV("Only a double can be stored into a lane or element");
+    EmitLocation(this);
+    Value* Vec = Base->codegen();
+    if (!Vec)
+        return nullptr;
+    if (isArray(Vec)) {
+        Value* Ptr = GetElementAddress(Vec, *Index);
+        if (!Ptr)
+            return nullptr;
+        S->Builder->CreateStore(Val, Ptr);
+        return Val;
+    }
+    int Lane = GetLaneIndex(Vec, *Index);
+    if (Lane < 0)
+        return nullptr;
+    if (!Base->codegenAssign(S->Builder->CreateInsertElement(Vec, Val, (uint64_t)Lane)))
+        return nullptr;
+    return Val;
+}
+
+Value* BinaryExprAST::codegen() {
+    // Operands are generated in post-order. Each entry is an operator node and
+    // how many of its operands have been generated; their values wait on
+    // Values. Assignment generates its right operand only, then stores it.
+    struct PendingNode {
+        const BinaryExprAST* E;
+        unsigned Done;
+    };
+    SmallVector<PendingNode, 16> Work{ { this, 0 } };
+    SmallVector<Value*, 16> Values;
+    while (!Work.empty()) {
+        PendingNode& N = Work.back();
+        const BinaryExprAST* E = N.E;
+        unsigned NumOperands = E->Op == '=' ? 1 : 2;
+        if (N.Done != NumOperands) {
+            if (N.Done == 0)
+                EmitLocation(E);
+            ExprAST* Operand = N.Done == 0 && NumOperands == 2 ? E->LHS : E->RHS;
+            ++N.Done;
+            if (const BinaryExprAST* B = Operand->asBinary())
+                Work.push_back({ B, 0 }); // Invalidates N
+            else
+                Values.push_back(Operand->codegen());
+            continue;
+        }
+
+        Work.pop_back();
+        Value* R = Values.pop_back_val();
+        Value* L = NumOperands == 2 ? Values.pop_back_val() : nullptr;
+        if (!R || (NumOperands == 2 && !L)) {
+            Values.push_back(nullptr);
+            continue;
+        }
+        EmitLocation(E);
+        // Assignment evaluates to the value stored
+        Values.push_back(E->Op == '=' ? E->LHS->codegenAssign(R) : E->codegenOp(L, R));
+    }
+    return Values.back();
+}
+
+Value* BinaryExprAST::codegenOp(Value* L, Value* R) const {
+    if (Op != ':' && (isArray(L) || isArray(R)))
+        return LogErrorV("Arrays can only be indexed, assigned or passed to functions");
+
+    // Arithmetic on vectors is element-wise, with a double operand applied to
+    // every lane
+    if (Op != ':' && L->getType() != R->getType()) {
+        auto* VecTy = dyn_cast<FixedVectorType>(L->getType());
+        if (!VecTy)
+            VecTy = cast<FixedVectorType>(R->getType());
+        if (L->getType()->isVectorTy() && R->getType()->isVectorTy())
+            return LogErrorV("Vector operands have different widths");
+        if (!L->getType()->isVectorTy())
+            L = S->Builder->CreateVectorSplat(VecTy->getNumElements(), L, "splat");
+        else
+            R = S->Builder->CreateVectorSplat(VecTy->getNumElements(), R, "splat");
+    }
+
+    switch (Op) {
+    case '+':
+        return S->Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+        return S->Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+        return S->Builder->CreateFMul(L, R, "multmp");
+    case '<':
+        // Convert bool 0/1 to double 0.0 or 1.0, lane by lane for vectors
+        return S->Builder->CreateUIToFP(S->Builder->CreateFCmpULT(L, R, "cmptmp"),
+            L->getType(), "booltmp");
+    case ':':
+        // Sequencing: L has been evaluated for its effects
+        return R;
+    default:
+        return LogErrorV("invalid binary operator");
+    }
+}
+
+Value* CallExprAST::codegen() {
+    EmitLocation(this);
+    StringRef Name = S->Interner.getName(Callee);
+    if (isBuiltin(Name))
+        return CodegenBuiltin(Name, Args);
+
+    // Look up the name in the Module's symbol table
+    Function* CalleeF = getFunction(Callee);
+    if (!CalleeF)
+        return LogErrorV("Unknown function referenced");
+
+    // CalleeF is the callee's function definition
+    // The Args refer to the the arguments passed in when a call to CalleeF is made
+    // Args.size() depends on user input for calling, CalleeF depends on the function definition
+    if (CalleeF->arg_size() != Args.size())
+        return LogErrorV("Incorrect # arguments passed");
+
+    // Codegen'ing call arguments
+    std::vector<Value*> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        ArgsV.push_back(Args[i]->codegen());
+        if (!ArgsV.back())
+            return nullptr;
+        if (ArgsV.back()->getType() != CalleeF->getArg(i)->getType())
+            return LogErrorV("Argument type does not match the prototype");
+    }
+    EmitLocation(this);
+
+    // A self-recursive tail call reuses the frame: rebind the parameters and
+    // jump back to the top of the body. Code after it is unreachable.
+    Function* TheFunction = S->Builder->GetInsertBlock()->getParent();
+    if (IsTail && CalleeF == TheFunction) {
+        for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+            S->Builder->CreateStore(ArgsV[i], S->ParamAllocas[i]);
+        S->Builder->CreateBr(S->TailCallHeader);
+        S->Builder->SetInsertPoint(BasicBlock::Create(*S->TheContext, "tailcall.dead",
+            TheFunction));
+        return UndefValue::get(TheFunction->getReturnType());
+    }
+
+    return S->Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+Value* IfExprAST::codegen() {
+    EmitLocation(this);
+    // Convert condition to a bool by comparing non-equal to 0.0
+    Value* CondV = CodegenCondition(*Cond, "ifcond");
+    if (!CondV)
+        return nullptr;
+
+    Function* TheFunction = S->Builder->GetInsertBlock()->getParent();
+    BasicBlock* ThenBB = BasicBlock::Create(*S->TheContext, "then", TheFunction);
+    BasicBlock* ElseBB = BasicBlock::Create(*S->TheContext, "else", TheFunction);
+    BasicBlock* MergeBB = BasicBlock::Create(*S->TheContext, "ifcont", TheFunction);
+    S->Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    S->Builder->SetInsertPoint(ThenBB);
+    Value* ThenV = Then->codegen();
+    if (!ThenV)
+        return nullptr;
+    S->Builder->CreateBr(MergeBB);
+    // Codegen of 'Then' can change the current block
+    ThenBB = S->Builder->GetInsertBlock();
+
+    S->Builder->SetInsertPoint(ElseBB);
+    Value* ElseV = Else->codegen();
+    if (!ElseV)
+        return nullptr;
+    S->Builder->CreateBr(MergeBB);
+    ElseBB = S->Builder->GetInsertBlock();
+
+    if (ThenV->getType() != ElseV->getType())
+        return LogErrorV("then and else branches have different types");
+
+    S->Builder->SetInsertPoint(MergeBB);
+    PHINode* PN = S->Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+Value* ForExprAST::codegen() {
+    EmitLocation(this);
+    Function* TheFunction = S->Builder->GetInsertBlock()->getParent();
+
+    // The start value is evaluated before the loop variable is in scope
+    AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+        Type::getDoubleTy(*S->TheContext));
+    Value* StartVal = Start->codegen();
+    if (!StartVal)
+        return nullptr;
+    if (!StartVal->getType()->isDoubleTy())
+        return LogErrorV("The loop variable must be a double");
+    S->Builder->CreateStore(StartVal, Alloca);
+    AllocaInst* OldVal = BindVariable(VarName, Alloca);
+
+    BasicBlock* CondBB = BasicBlock::Create(*S->TheContext, "loopcond", TheFunction);
+    BasicBlock* LoopBB = BasicBlock::Create(*S->TheContext, "loop", TheFunction);
+    BasicBlock* AfterBB = BasicBlock::Create(*S->TheContext, "afterloop", TheFunction);
+    S->Builder->CreateBr(CondBB);
+
+    S->Builder->SetInsertPoint(CondBB);
+    Value* EndCond = CodegenCondition(*End, "loopcond");
+    if (!EndCond)
+        return nullptr;
+    S->Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+
+    // The body is evaluated for its effects; its value is ignored
+    S->Builder->SetInsertPoint(LoopBB);
+    if (!Body->codegen())
+        return nullptr;
+
+    Value* StepVal = Step ? Step->codegen()
+                          : ConstantFP::get(*S->TheContext, APFloat(1.0));
+    if (!StepVal)
+        return nullptr;
+    if (!StepVal->getType()->isDoubleTy())
+        return LogErrorV("The loop step must be a double");
+    Value* CurVar = S->Builder->CreateLoad(Alloca->getAllocatedType(), Alloca,
+        S->Interner.getName(VarName));
+    S->Builder->CreateStore(S->Builder->CreateFAdd(CurVar, StepVal, "nextvar"), Alloca);
+    S->Builder->CreateBr(CondBB);
+
+    S->Builder->SetInsertPoint(AfterBB);
+    RestoreVariable(VarName, OldVal);
+    return Constant::getNullValue(Type::getDoubleTy(*S->TheContext));
+}
+
+Value* VarExprAST::codegen() {
+    EmitLocation(this);
+    Function* TheFunction = S->Builder->GetInsertBlock()->getParent();
+
+    // Each initializer sees the variables declared before it, but not its own
+    SmallVector<AllocaInst*, 4> OldBindings;
+    for (auto& Var : Vars) {
+        Value* InitVal = Var.second ? Var.second->codegen()
+                                    : ConstantFP::get(*S->TheContext, APFloat(0.0));
+        if (!InitVal)
+            return nullptr;
+        AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, Var.first,
+            InitVal->getType());
+        S->Builder->CreateStore(InitVal, Alloca);
+        OldBindings.push_back(BindVariable(Var.first, Alloca));
+    }
+
+    Value* BodyVal = Body->codegen();
+    if (!BodyVal)
+        return nullptr;
+
+    // Unbind in reverse, in case a name was declared twice
+    for (unsigned i = Vars.size(); i-- != 0;)
+        RestoreVariable(Vars[i].first, OldBindings[i]);
+    return BodyVal;
+}
+
+// Declare Function Signature
+Function* PrototypeAST::codegen() {
+    // Create a vector of Type pointers for function arguments, doubles or
+    // vectors of doubles
+    std::vector<Type*> ArgTypes;
+    for (unsigned Lanes : ArgLanes)
+        ArgTypes.push_back(getValueType(Lanes));
+    
+    // Create a FunctionType representing a function returning the declared type
+    // and taking arguments of the types in the vector created above
+    FunctionType* FT = 
+        FunctionType::get(getValueType(RetLanes), ArgTypes, false);
+
+    // Create a new Function instance with ExternalLinkage, the given name, and
+    // associated with the current module (TheModule)
+    // Implicitly generated IR for function args
+    // .get() retrives the raw pointer from TheModule to pass into the function
+    // The name is registered in TheModule's symbol tables
+    Function* F =
+        Function::Create(FT, Function::ExternalLinkage, getName(), S->TheModule.get());
+
+    // Set names (parameter names) for function arguments based on the names provided in the Args vector
+    unsigned Idx = 0;
+    for (auto& Arg : F->args())
+        Arg.setName(S->Interner.getName(Args[Idx++]));
+
+    // Return the generated LLVM function instance
+    // Function signitures in LLVM = functions but functions without bodies
+    return F;
+}
+
+Function* FunctionAST::codegen() {
+
+    // An earlier extern or definition may have declared the function with
+    // other types, and callers compiled against it expect those
+    auto PI = S->FunctionProtos.find(Name);
+    if (PI != S->FunctionProtos.end() && !PI->second->hasSameType(*Proto)) {
+        LogError("Definition does not match earlier prototype");
+        return nullptr;
+    }
+
+    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+    // reference to it for use below.
+    auto& P = *Proto;
+    S->FunctionProtos[Proto->getSymbol()] = std::move(Proto);
+    Function* TheFunction = getFunction(P.getSymbol());
+    if (!TheFunction)
+        return nullptr;
+
+    // In -batch mode an earlier definition may still be in this module
+    if (!TheFunction->empty()) {
+        LogError("Function cannot be redefined");
+        return nullptr;
+    }
+
+    // Create a basic block named 'entry' in the function
+    BasicBlock* BB = BasicBlock::Create(*S->TheContext, "entry", TheFunction);
+    
+    // Set the insertion point for the IRBuilder to the new basic block 'entry'
+    S->Builder->SetInsertPoint(BB);
+
+    // Clear the map of NamedValues in the current scope (NamedValues could hold another function's values)
+    S->NamedValues.clear();
+    S->ParamAllocas.clear();
+    S->HostArrayViews.clear();
+
+    // With -g, the function's line table entries go under a subprogram of its
+    // own. The parameter setup has no location of its own.
+    if (S->DBuilder) {
+        DIBuilder& DB = *S->DBuilder;
+        S->CurSubprogram = DB.createFunction(S->DebugFile, P.getName(), StringRef(),
+            S->DebugFile, Line, DB.createSubroutineType(DB.getOrCreateTypeArray(None)),
+            Line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+        TheFunction->setSubprogram(S->CurSubprogram);
+    }
+
+    // Give each parameter a stack slot holding its incoming value, and add it
+    // to the NamedValues map so it can be resolved (and assigned) within the body
+    unsigned Idx = 0;
+    for (auto& Arg : TheFunction->args()) {
+        SymbolID ArgName = P.getArgs()[Idx++];
+        AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, ArgName,
+            Arg.getType());
+        S->Builder->CreateStore(&Arg, Alloca);
+        S->NamedValues[ArgName] = Alloca;
+        S->ParamAllocas.push_back(Alloca);
+    }
+
+    // The body starts in a block of its own, so self-recursive tail calls can
+    // branch back to it
+    Body->markTail();
+    S->TailCallHeader = BasicBlock::Create(*S->TheContext, "body", TheFunction);
+    S->Builder->CreateBr(S->TailCallHeader);
+    S->Builder->SetInsertPoint(S->TailCallHeader);
+    
+    // Generate code for the body of the function
+    Value* RetVal = Body->codegen();
+    if (RetVal && RetVal->getType() != TheFunction->getReturnType()) {
+        LogError(P.getName().startswith("__")
+            ? "Top-level expressions must evaluate to a double"
+            : "Body does not match the declared return type");
+        RetVal = nullptr;
+    }
+    // If the body code generation is successful, create a return instruction
+    if (RetVal)
+        S->Builder->CreateRet(RetVal);
+    if (S->CurSubprogram) {
+        S->DBuilder->finalizeSubprogram(S->CurSubprogram);
+        S->CurSubprogram = nullptr;
+        S->Builder->SetCurrentDebugLocation(DebugLoc());
+    }
+
+    if (RetVal) {
+        // Verify the function to ensure it is well-formed
+        verifyFunction(*TheFunction);
+        ++S->FunctionVersions[P.getSymbol()];
+
+        // Return the generated function
+        return TheFunction;
+    }
+
+    // If the body code generation is unsuccessful, erase the function and return nullptr
+    // If we didnt delete it, it would live in the symbol table, with a body, preventing future redefinition.
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+// Write F, alone in a module with declarations of its callees, as bitcode so
+// a copy can be loaded into another context. Fails if F refers to anything
+// other than functions and declared globals, such as host arrays.
+static bool CloneFunctionToBitcode(Function& F, StringRef Name,
+    GlobalValue::LinkageTypes Linkage, SmallVectorImpl<char>& Bitcode) {
+    Module Copy(Name, F.getContext());
+    Copy.setDataLayout(F.getParent()->getDataLayout());
+    Copy.setTargetTriple(F.getParent()->getTargetTriple());
+    // Without it the bitcode reader assumes stale debug info and warns
+    Copy.addModuleFlag(Module::Warning, "Debug Info Version",
+        DEBUG_METADATA_VERSION);
+    Function* NewF = Function::Create(F.getFunctionType(), Linkage, Name, &Copy);
+
+    ValueToValueMapTy VMap;
+    VMap[&F] = NewF;
+    auto NewArg = NewF->arg_begin();
+    for (auto& Arg : F.args()) {
+        NewArg->setName(Arg.getName());
+        VMap[&Arg] = &*NewArg++;
+    }
+    SmallVector<Value*, 32> Worklist;
+    for (auto& I : instructions(F))
+        Worklist.append(I.op_begin(), I.op_end());
+    SmallPtrSet<Constant*, 16> Seen;
+    while (!Worklist.empty()) {
+        auto* C = dyn_cast<Constant>(Worklist.pop_back_val());
+        if (!C || !Seen.insert(C).second)
+            continue;
+        auto* GV = dyn_cast<GlobalValue>(C);
+        if (!GV) {
+            // Globals can hide in constant expressions, such as a GEP of one
+            Worklist.append(C->op_begin(), C->op_end());
+            continue;
+        }
+        if (VMap.count(GV))
+            continue;
+        // F's own stub, when it calls itself under another name
+        if (GV->getName() == Name) {
+            VMap[GV] = NewF;
+            continue;
+        }
+        if (auto* G = dyn_cast<GlobalVariable>(GV)) {
+            if (!G->isDeclaration())
+                return false;
+            VMap[G] = new GlobalVariable(Copy, G->getValueType(), G->isConstant(),
+                GlobalValue::ExternalLinkage, nullptr, G->getName());
+            continue;
+        }
+        auto* Callee = dyn_cast<Function>(GV);
+        if (!Callee)
+            return false;
+        VMap[Callee] = Function::Create(Callee->getFunctionType(),
+            Function::ExternalLinkage, Callee->getName(), &Copy);
+    }
+
+    SmallVector<ReturnInst*, 4> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule,
+        Returns);
+    NewF->setLinkage(Linkage);
+    // CloneFunctionInto lists the compile units it reaches through instruction
+    // locations, which misses that of a body with none, such as a constant
+    if (DISubprogram* SP = NewF->getSubprogram()) {
+        NamedMDNode* CUs = Copy.getOrInsertNamedMetadata("llvm.dbg.cu");
+        if (!is_contained(CUs->operands(), SP->getUnit()))
+            CUs->addOperand(SP->getUnit());
+    }
+
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(Copy, OS);
+    return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Interpreter
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned> TierThreshold("tier-threshold",
+    cl::desc("Interpret top-level expressions and functions until they have "
+             "run this many times, then JIT them (0 = always JIT)"),
+    cl::init(0));
+
+// Stack bytecode. Operands follow their opcode in the same stream.
+enum Opcode : uint64_t {
+    OP_Const, // <double bits>      push a constant
+    OP_Arg,   // <index>            push an argument
+    OP_Add,   //                    pop two values, push the result
+    OP_Sub,
+    OP_Mul,
+    OP_Lt,
+    OP_Call,  // <TieredFunction*>  pop the callee's arguments, push its result
+    OP_Ret    //                    return the top of the stack
+};
+
+// Native code is called through a prototype with at most this many arguments
+static const unsigned MaxNativeArgs = 8;
+
+/// TieredFunction - A def or extern as the interpreter sees it. A def runs
+/// from its bytecode until it has been called TierThreshold times and is then
+/// looked up in the JIT. Externs, and defs that could not be lowered, go
+/// native on their first call.
+struct TieredFunction {
+    SymbolID Name;
+    unsigned NumArgs;
+    std::vector<uint64_t> Code; // Empty if the function has no bytecode
+    unsigned MaxDepth = 0;      // Operand stack slots needed by Code
+    unsigned Calls = 0;
+    void* Native = nullptr;
+};
+
+// The interpreter's entry for a function with a known prototype, or null
+static TieredFunction* getTieredFunction(SymbolID Name) {
+    auto TI = S->TieredFunctions.find(Name);
+    if (TI != S->TieredFunctions.end())
+        return TI->second.get();
+
+    // Vector arguments or results can't live on the operand stack
+    auto PI = S->FunctionProtos.find(Name);
+    if (PI == S->FunctionProtos.end() || !PI->second->isScalar())
+        return nullptr;
+    auto F = std::make_unique<TieredFunction>();
+    F->Name = Name;
+    F->NumArgs = PI->second->getArgs().size();
+    return (S->TieredFunctions[Name] = std::move(F)).get();
+}
+
+namespace {
+    /// BytecodeBuilder - Emits one function's bytecode and tracks the operand
+    /// stack depth. Lowering never reports errors: anything it cannot handle
+    /// is left to codegen, which reports it as usual.
+    class BytecodeBuilder {
+        ArrayRef<SymbolID> Params;
+        std::vector<uint64_t>& Code;
+        unsigned Depth = 0, MaxDepth = 0;
+
+        void adjustDepth(int Delta) {
+            Depth += Delta;
+            MaxDepth = std::max(MaxDepth, Depth);
+        }
+    public:
+        BytecodeBuilder(ArrayRef<SymbolID> Params, std::vector<uint64_t>& Code)
+            : Params(Params), Code(Code) {}
+
+        unsigned getMaxDepth() const { return MaxDepth; }
+
+        void emitConst(double Val) {
+            Code.push_back(OP_Const);
+            Code.push_back(bit_cast<uint64_t>(Val));
+            adjustDepth(1);
+        }
+
+        bool emitArg(SymbolID Name) {
+            auto It = std::find(Params.begin(), Params.end(), Name);
+            if (It == Params.end())
+                return false;
+            Code.push_back(OP_Arg);
+            Code.push_back(It - Params.begin());
+            adjustDepth(1);
+            return true;
+        }
+
+        void emitBinary(Opcode Op) {
+            Code.push_back(Op);
+            adjustDepth(-1);
+        }
+
+        bool emitCall(SymbolID Callee, unsigned NumArgs) {
+            TieredFunction* F = getTieredFunction(Callee);
+            if (!F || F->NumArgs != NumArgs)
+                return false;
+            // Without bytecode the callee can only be called natively
+            if (F->Code.empty() && NumArgs > MaxNativeArgs)
+                return false;
+            Code.push_back(OP_Call);
+            Code.push_back(reinterpret_cast<uintptr_t>(F));
+            adjustDepth(1 - (int)NumArgs);
+            return true;
+        }
+
+        void emitRet() { Code.push_back(OP_Ret); }
+    };
+}
+
+bool NumberExprAST::lower(BytecodeBuilder& B) {
+    B.emitConst(Val);
+    return true;
+}
+
+bool VariableExprAST::lower(BytecodeBuilder& B) {
+    return B.emitArg(Name);
+}
+
+bool BinaryExprAST::lower(BytecodeBuilder& B) {
+    // Post-order, without recursing into operator nodes. An operator's entry
+    // is revisited, with Expanded set, once both operands have been lowered.
+    struct PendingNode {
+        ExprAST* E;
+        bool Expanded;
+    };
+    SmallVector<PendingNode, 16> Work{ { this, false } };
+    while (!Work.empty()) {
+        PendingNode N = Work.pop_back_val();
+        const BinaryExprAST* E = N.E->asBinary();
+        if (!E) {
+            if (!N.E->lower(B))
+                return false;
+            continue;
+        }
+        if (!N.Expanded) {
+            Work.push_back({ N.E, true });
+            Work.push_back({ E->RHS, false });
+            Work.push_back({ E->LHS, false });
+            continue;
+        }
+
+        switch (E->Op) {
+        case '+': B.emitBinary(OP_Add); break;
+        case '-': B.emitBinary(OP_Sub); break;
+        case '*': B.emitBinary(OP_Mul); break;
+        case '<': B.emitBinary(OP_Lt); break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+bool CallExprAST::lower(BytecodeBuilder& B) {
+    for (auto* Arg : Args)
+        if (!Arg->lower(B))
+            return false;
+    return B.emitCall(Callee, Args.size());
+}
+
+// Control flow, locals and vectors are left to the JIT
+bool IndexExprAST::lower(BytecodeBuilder&) { return false; }
+bool IfExprAST::lower(BytecodeBuilder&) { return false; }
+bool ForExprAST::lower(BytecodeBuilder&) { return false; }
+bool VarExprAST::lower(BytecodeBuilder&) { return false; }
+
+bool FunctionAST::lower(TieredFunction& F) {
+    // A definition's prototype has already moved to FunctionProtos
+    ArrayRef<SymbolID> Params = Proto ? Proto->getArgs()
+                                      : S->FunctionProtos[Name]->getArgs();
+    F.Code.clear();
+    BytecodeBuilder B(Params, F.Code);
+    if (!Body->lower(B)) {
+        F.Code.clear();
+        return false;
+    }
+    B.emitRet();
+    F.MaxDepth = B.getMaxDepth();
+    return true;
+}
+
+static void FlushPendingDefinitions();
+
+static double CallNative(void* Addr, unsigned NumArgs, const double* A) {
+    using D = double;
+    switch (NumArgs) {
+    case 0: return ((D(*)())Addr)();
+    case 1: return ((D(*)(D))Addr)(A[0]);
+    case 2: return ((D(*)(D, D))Addr)(A[0], A[1]);
+    case 3: return ((D(*)(D, D, D))Addr)(A[0], A[1], A[2]);
+    case 4: return ((D(*)(D, D, D, D))Addr)(A[0], A[1], A[2], A[3]);
+    case 5: return ((D(*)(D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3], A[4]);
+    case 6: return ((D(*)(D, D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3], A[4], A[5]);
+    case 7: return ((D(*)(D, D, D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3], A[4], A[5], A[6]);
+    default: return ((D(*)(D, D, D, D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+    }
+}
+
+// Resolve F in the JIT, compiling it if needed
+static void* PromoteFunction(TieredFunction& F) {
+    FlushPendingDefinitions();
+    auto Sym = ExitOnErr(S->TheJIT->lookup(S->Interner.getName(F.Name)));
+    return (void*)(intptr_t)Sym.getAddress();
+}
+
+static double CallTiered(TieredFunction& F, size_t ArgBase);
+
+// Run F's bytecode with its arguments at InterpStack[ArgBase...]
+static double Interpret(const TieredFunction& F, size_t ArgBase) {
+    size_t SP = ArgBase + F.NumArgs;
+    if (S->InterpStack.size() < SP + F.MaxDepth)
+        S->InterpStack.resize(std::max(SP + F.MaxDepth, 2 * S->InterpStack.size()));
+    double* Stack = S->InterpStack.data();
+
+    for (const uint64_t* PC = F.Code.data();;) {
+        switch (*PC++) {
+        case OP_Const:
+            Stack[SP++] = bit_cast<double>(*PC++);
+            break;
+        case OP_Arg:
+            Stack[SP++] = Stack[ArgBase + *PC++];
+            break;
+        case OP_Add:
+            --SP;
+            Stack[SP - 1] += Stack[SP];
+            break;
+        case OP_Sub:
+            --SP;
+            Stack[SP - 1] -= Stack[SP];
+            break;
+        case OP_Mul:
+            --SP;
+            Stack[SP - 1] *= Stack[SP];
+            break;
+        case OP_Lt:
+            // Unordered compare, as in codegen: NaN operands give 1.0
+            --SP;
+            Stack[SP - 1] = !(Stack[SP - 1] >= Stack[SP]) ? 1.0 : 0.0;
+            break;
+        case OP_Call: {
+            auto& Callee = *reinterpret_cast<TieredFunction*>(*PC++);
+            SP -= Callee.NumArgs;
+            double Result = CallTiered(Callee, SP);
+            Stack = S->InterpStack.data();
+            Stack[SP++] = Result;
+            break;
+        }
+        case OP_Ret:
+            return Stack[SP - 1];
+        }
+    }
+}
+
+static double CallTiered(TieredFunction& F, size_t ArgBase) {
+    if (!F.Native && F.NumArgs <= MaxNativeArgs &&
+        (F.Code.empty() || ++F.Calls >= S->Opts.TierThreshold))
+        F.Native = PromoteFunction(F);
+    if (F.Native)
+        return CallNative(F.Native, F.NumArgs, S->InterpStack.data() + ArgBase);
+    return Interpret(F, ArgBase);
+}
+
+//===----------------------------------------------------------------------===//
+// Expression Cache
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned> ExprCacheSize("expr-cache-size",
+    cl::desc("Keep this many JIT'd top-level expressions for reuse when the "
+             "same expression is entered again (0 = discard after running)"),
+    cl::init(64));
+
+namespace {
+    // What evaluating some code may do besides computing its result. Worked
+    // out from the syntax, before types are known, so indexing a vector counts
+    // as touching memory too.
+    enum EffectBits : unsigned {
+        EF_ReadsMemory = 1 << 0,  // reads an element of an array
+        EF_WritesMemory = 1 << 1, // assigns to one
+        EF_Native = 1 << 2,       // calls native code: an extern or an output builtin
+    };
+
+    /// ExprKey - Structural identity of a top-level expression: its tree shape,
+    /// constants and names, plus the version of every function it calls.
+    struct ExprKey {
+        SmallVector<uint64_t, 32> Data;
+        SmallVector<SymbolID, 4> Callees;
+        unsigned Effects = 0; // EffectBits of the expression itself, not its calls
+
+        void add(uint64_t V) { Data.push_back(V); }
+
+        StringRef getBytes() const {
+            return StringRef((const char*)Data.data(), Data.size() * sizeof(uint64_t));
+        }
+    };
+}
+
+void NumberExprAST::profile(ExprKey& K) const {
+    K.add('n');
+    K.add(bit_cast<uint64_t>(Val));
+}
+
+void VariableExprAST::profile(ExprKey& K) const {
+    K.add('v');
+    K.add(Name);
+}
+
+void BinaryExprAST::profile(ExprKey& K) const {
+    // Pre-order, with the operands still to visit on an explicit stack. The
+    // flag marks the destination of '='.
+    SmallVector<std::pair<const ExprAST*, bool>, 16> Work{ { this, false } };
+    while (!Work.empty()) {
+        auto N = Work.pop_back_val();
+        const BinaryExprAST* E = N.first->asBinary();
+        if (!E) {
+            if (N.second)
+                N.first->profileAssign(K);
+            else
+                N.first->profile(K);
+            continue;
+        }
+        K.add('b');
+        K.add(E->Op);
+        Work.push_back({ E->RHS, false });
+        Work.push_back({ E->LHS, E->Op == '=' });
+    }
+}
+
+void CallExprAST::profile(ExprKey& K) const {
+    K.add('c');
+    K.add(Callee);
+    K.add(S->FunctionVersions.lookup(Callee));
+    K.add(Args.size());
+    for (auto* Arg : Args)
+        Arg->profile(K);
+    if (!is_contained(K.Callees, Callee))
+        K.Callees.push_back(Callee);
+}
+
+void IndexExprAST::profile(ExprKey& K) const {
+    K.add('x');
+    K.Effects |= EF_ReadsMemory;
+    Base->profile(K);
+    Index->profile(K);
+}
+
+void IndexExprAST::profileAssign(ExprKey& K) const {
+    profile(K);
+    K.Effects |= EF_WritesMemory;
+}
+
+void IfExprAST::profile(ExprKey& K) const {
+    K.add('i');
+    Cond->profile(K);
+    Then->profile(K);
+    Else->profile(K);
+}
+
+void ForExprAST::profile(ExprKey& K) const {
+    K.add('f');
+    K.add(VarName);
+    K.add(Step != nullptr);
+    Start->profile(K);
+    End->profile(K);
+    if (Step)
+        Step->profile(K);
+    Body->profile(K);
+}
+
+void VarExprAST::profile(ExprKey& K) const {
+    K.add('V');
+    K.add(Vars.size());
+    for (auto& Var : Vars) {
+        K.add(Var.first);
+        K.add(Var.second != nullptr);
+        if (Var.second)
+            Var.second->profile(K);
+    }
+    Body->profile(K);
+}
+
+struct CachedExpr {
+    std::string Key;
+    ResourceTrackerSP RT;
+    double (*Native)();
+    SmallVector<SymbolID, 4> Callees;
+};
+
+static void EvictCachedExpr(std::list<CachedExpr>::iterator It) {
+    ExitOnErr(S->TheJIT->removeModule(std::move(It->RT)));
+    S->ExprCacheIndex.erase(It->Key);
+    S->ExprCacheLRU.erase(It);
+}
+
+// The JIT'd function for K, or null
+static double (*LookupCachedExpr(const ExprKey& K))() {
+    auto It = S->ExprCacheIndex.find(K.getBytes());
+    if (It == S->ExprCacheIndex.end()) {
+        ++S->ExprCacheMisses;
+        return nullptr;
+    }
+    ++S->ExprCacheHits;
+    S->ExprCacheLRU.splice(S->ExprCacheLRU.begin(), S->ExprCacheLRU, It->second);
+    return It->second->Native;
+}
+
+// Take ownership of a JIT'd expression, evicting the least recently used
+// entry if the cache is full.
+static void InsertCachedExpr(const ExprKey& K, ResourceTrackerSP RT,
+    double (*Native)()) {
+    if (S->ExprCacheLRU.size() == S->Opts.ExprCacheSize)
+        EvictCachedExpr(std::prev(S->ExprCacheLRU.end()));
+    S->ExprCacheLRU.push_front({ K.getBytes().str(), std::move(RT), Native, K.Callees });
+    S->ExprCacheIndex[K.getBytes()] = S->ExprCacheLRU.begin();
+}
+
+// Drop the expressions that call Name directly, now that it has a new body.
+// Their keys name the old version, so they could never be hit again anyway.
+static void InvalidateCachedExprs(SymbolID Name) {
+    for (auto It = S->ExprCacheLRU.begin(); It != S->ExprCacheLRU.end();) {
+        auto Next = std::next(It);
+        if (is_contained(It->Callees, Name))
+            EvictCachedExpr(It);
+        It = Next;
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Profile-guided Tier-up
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned> PGOThreshold("pgo-threshold",
+    cl::desc("Count function entries and loop iterations, and once a count "
+             "reaches this value recompile the function at -O3 with the "
+             "collected profile in the background (0 = off)"),
+    cl::init(0));
+
+/// ProfiledFunction - A definition compiled with counters. Counters are
+/// indexed by the position of their basic block in the uninstrumented IR,
+/// which is kept as bitcode for the recompile. Never freed, since JIT'd code
+/// holds the counters' addresses. The JIT resolves __prof.<id>.counters and
+/// __prof.<id>.requested to Counters and TierUpRequested.
+struct ProfiledFunction {
+    std::string Name;
+    unsigned Version;
+    SmallVector<char, 0> Bitcode;
+    std::unique_ptr<uint64_t[]> Counters;
+    unsigned NumCounters = 0;
+    std::vector<std::string> Callees;
+    std::atomic<bool> TierUpRequested{ false };
+};
+
+// A recompiled body waiting for the session's thread to swap it in
+struct TierUp {
+    ProfiledFunction* Profile;
+    JITTargetAddress Impl;
+    ResourceTrackerSP RT;
+};
+// Attach P's counts to F, a copy of its uninstrumented IR, as an entry count
+// and branch weights. An edge is weighted with the count of the block it
+// leads to, which is exact when that block has no other predecessors.
+static void ApplyProfile(Function& F, const ProfiledFunction& P,
+    InstrProfSummaryBuilder& Summary) {
+    std::vector<uint64_t> Counts(P.Counters.get(), P.Counters.get() + P.NumCounters);
+    Summary.addRecord(InstrProfRecord(Counts));
+    F.setEntryCount(Function::ProfileCount(Counts[0], Function::PCT_Real));
+
+    DenseMap<BasicBlock*, uint64_t> BlockCounts;
+    unsigned Idx = 0;
+    for (auto& BB : F)
+        BlockCounts[&BB] = Counts[Idx++];
+    assert(Idx == P.NumCounters && "Blocks don't match the counters");
+
+    // Weights are 32-bit
+    uint64_t Max = *std::max_element(Counts.begin(), Counts.end());
+    unsigned Shift = Max > UINT32_MAX ? Log2_64(Max) - 31 : 0;
+    MDBuilder MDB(F.getContext());
+    for (auto& BB : F)
+        if (auto* Br = dyn_cast<BranchInst>(BB.getTerminator()))
+            if (Br->isConditional())
+                Br->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                    BlockCounts[Br->getSuccessor(0)] >> Shift,
+                    BlockCounts[Br->getSuccessor(1)] >> Shift));
+}
+
+// Runs on TierUpThread. Rebuilds P from its bitcode with the profile so far,
+// brings in profiled copies of the functions it calls for the inliner, and
+// compiles the result at -O3 under a name of its own.
+static void RecompileWithProfile(ProfiledFunction& P,
+    std::vector<ProfiledFunction*> Callees) {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto Load = [&](const ProfiledFunction& From) {
+        return ExitOnErr(parseBitcodeFile(MemoryBufferRef(
+            StringRef(From.Bitcode.data(), From.Bitcode.size()), From.Name), *Ctx));
+    };
+
+    InstrProfSummaryBuilder Summary(ProfileSummaryBuilder::DefaultCutoffs.vec());
+    auto M = Load(P);
+    Function* F = M->getFunction(P.Name);
+    ApplyProfile(*F, P, Summary);
+    for (auto* Callee : Callees) {
+        auto CalleeM = Load(*Callee);
+        Function* CalleeF = CalleeM->getFunction(Callee->Name);
+        CalleeF->setLinkage(Function::AvailableExternallyLinkage);
+        ApplyProfile(*CalleeF, *Callee, Summary);
+        Linker::linkModules(*M, std::move(CalleeM));
+    }
+    M->setProfileSummary(Summary.getSummary()->getMD(*Ctx), ProfileSummary::PSK_Instr);
+    // Picked up by OptimizeModule
+    M->addModuleFlag(Module::Warning, "kaleidoscope.pgo", 1);
+
+    std::string ImplName = (P.Name + ".v" + Twine(P.Version) + ".pgo").str();
+    F->setName(ImplName);
+
+    auto RT = S->TheJIT->getMainJITDylib().createResourceTracker();
+    ExitOnErr(S->TheJIT->addModule(ThreadSafeModule(std::move(M), std::move(Ctx)), RT));
+    auto Impl = ExitOnErr(S->TheJIT->lookup(ImplName));
+
+    std::lock_guard<std::mutex> Lock(S->ProfileMutex);
+    S->ReadyTierUps.push_back({ &P, Impl.getAddress(), std::move(RT) });
+}
+
+// Called from instrumented code through __pgo.request_tier_up when a counter
+// reaches PGOThreshold, on whichever thread runs it. The JIT resolves
+// __pgo.session to Owner.
+static void RequestTierUp(Session* Owner, uint64_t Id) {
+    SessionScope Scope(*Owner);
+    ProfiledFunction* P;
+    std::vector<ProfiledFunction*> Callees;
+    {
+        std::lock_guard<std::mutex> Lock(S->ProfileMutex);
+        P = S->ProfiledFunctions[Id].get();
+        if (P->TierUpRequested.exchange(true) || S->ProfiledByName.lookup(P->Name) != P)
+            return;
+        // Everything reachable from P, since each callee still calls its own
+        // callees through their stubs.
+        SmallPtrSet<ProfiledFunction*, 16> Seen = { P };
+        for (unsigned I = 0; S->Opts.InlineIntoTierUps && I <= Callees.size(); ++I)
+            for (auto& Name : (I ? Callees[I - 1] : P)->Callees)
+                if (auto* Callee = S->ProfiledByName.lookup(Name))
+                    if (Seen.insert(Callee).second)
+                        Callees.push_back(Callee);
+    }
+    S->TierUpThread->async([Owner, P, Callees] {
+        SessionScope Scope(*Owner);
+        RecompileWithProfile(*P, Callees);
+    });
+}
+
+// Keep F's uninstrumented IR and add a counter to each basic block, so the
+// entry block counts calls and loop headers count iterations. Those two kinds
+// of block also call RequestTierUp when their count reaches PGOThreshold.
+// Counters are bumped atomically since -expr-threads and -map-threads run
+// the same code on several threads. Host addresses are reached through
+// symbols rather than constants, so the IR, and with it the object cache key,
+// is the same on every run.
+static void InstrumentForProfile(Function& F, unsigned Version) {
+    auto Owned = std::make_unique<ProfiledFunction>();
+    ProfiledFunction& P = *Owned;
+    P.Name = F.getName().str();
+    P.Version = Version;
+    if (!CloneFunctionToBitcode(F, P.Name, Function::ExternalLinkage, P.Bitcode))
+        return;
+    for (auto& I : instructions(F))
+        if (auto* Call = dyn_cast<CallBase>(&I))
+            if (auto* Callee = Call->getCalledFunction())
+                if (Callee != &F && !Callee->isIntrinsic() &&
+                    !is_contained(P.Callees, Callee->getName()))
+                    P.Callees.push_back(Callee->getName().str());
+
+    SmallVector<BasicBlock*, 16> Blocks;
+    SmallPtrSet<BasicBlock*, 4> TierUpPoints;
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    for (auto& BB : F) {
+        if (Blocks.empty() || LI.isLoopHeader(&BB))
+            TierUpPoints.insert(&BB);
+        Blocks.push_back(&BB);
+    }
+    P.NumCounters = Blocks.size();
+    P.Counters.reset(new uint64_t[P.NumCounters]());
+
+    uint64_t Id;
+    {
+        std::lock_guard<std::mutex> Lock(S->ProfileMutex);
+        Id = S->ProfiledFunctions.size();
+        S->ProfiledByName[P.Name] = &P;
+        S->ProfiledFunctions.push_back(std::move(Owned));
+    }
+
+    std::string Prefix = ("__prof." + Twine(Id)).str();
+    ExitOnErr(S->TheJIT->defineAbsolute(Prefix + ".counters", P.Counters.get()));
+    ExitOnErr(S->TheJIT->defineAbsolute(Prefix + ".requested", &P.TierUpRequested));
+
+    LLVMContext& Ctx = F.getContext();
+    Module& M = *F.getParent();
+    Type* I8 = Type::getInt8Ty(Ctx);
+    Type* I64 = Type::getInt64Ty(Ctx);
+    auto* Counters = new GlobalVariable(M, ArrayType::get(I64, P.NumCounters),
+        /*isConstant=*/false, GlobalValue::ExternalLinkage, nullptr, Prefix + ".counters");
+    auto* Requested = new GlobalVariable(M, I8, /*isConstant=*/false,
+        GlobalValue::ExternalLinkage, nullptr, Prefix + ".requested");
+    Constant* Owner = M.getOrInsertGlobal("__pgo.session", I8);
+    FunctionCallee Callback = M.getOrInsertFunction("__pgo.request_tier_up",
+        FunctionType::get(Type::getVoidTy(Ctx), { I8->getPointerTo(), I64 }, false));
+    for (unsigned Idx = 0; Idx != Blocks.size(); ++Idx) {
+        // Stay behind the entry block's allocas so mem2reg still sees them
+        auto InsertPt = Blocks[Idx]->getFirstInsertionPt();
+        while (isa<AllocaInst>(*InsertPt))
+            ++InsertPt;
+
+        IRBuilder<> B(&*InsertPt);
+        Value* Counter = B.CreateConstInBoundsGEP2_64(Counters->getValueType(), Counters, 0, Idx);
+        Value* Count = B.CreateAdd(B.CreateAtomicRMW(AtomicRMWInst::Add, Counter,
+            B.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic), B.getInt64(1));
+        if (!TierUpPoints.count(Blocks[Idx]))
+            continue;
+
+        // Racing increments can step over the threshold, so test for having
+        // reached it, and the flag keeps later runs off the callback
+        auto* Cold = MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+        Instruction* Reached = SplitBlockAndInsertIfThen(
+            B.CreateICmpUGE(Count, B.getInt64(S->Opts.PGOThreshold)), &*InsertPt,
+            /*Unreachable=*/false, Cold);
+        IRBuilder<> RB(Reached);
+        LoadInst* Flag = RB.CreateLoad(I8, Requested);
+        Flag->setAtomic(AtomicOrdering::Monotonic);
+        Flag->setAlignment(Align(1));
+        Instruction* Then = SplitBlockAndInsertIfThen(
+            RB.CreateICmpEQ(Flag, RB.getInt8(0)), Reached, /*Unreachable=*/false);
+        IRBuilder<> TB(Then);
+        TB.CreateCall(Callback, { Owner, TB.getInt64(Id) });
+    }
+}
+
+static void ForgetBatchKernel(SymbolID Name);
+static void NoteCallees(FunctionAST& FnAST);
+static bool IsIndependent(const ExprKey& Key);
+static void HoldExpression(FunctionAST& FnAST, const ExprKey& Key);
+static void FlushExprRun();
+static bool CheckPure(const FunctionAST& FnAST);
+static void ResetMemoTables(SymbolID Redefined);
+static Function* MemoizeFunction(Function& F, unsigned Version);
+static void FlushOutput();
+
+// Swap in the bodies recompiled since the last call. Only called between
+// top-level items, when no JIT'd code is running.
+static void ApplyTierUps() {
+    std::vector<TierUp> Ready;
+    {
+        std::lock_guard<std::mutex> Lock(S->ProfileMutex);
+        Ready.swap(S->ReadyTierUps);
+    }
+    for (auto& T : Ready) {
+        // Drop recompiles of a function that was redefined in the meantime
+        if (S->ProfiledByName.lookup(T.Profile->Name) != T.Profile) {
+            ExitOnErr(S->TheJIT->removeModule(std::move(T.RT)));
+            continue;
+        }
+        ExitOnErr(S->TheJIT->replaceFunctionBody(T.Profile->Name, T.Impl, std::move(T.RT)));
+        ++S->NumTierUps;
+        // Recompile them so they can inline the new body
+        InvalidateCachedExprs(S->Interner.intern(T.Profile->Name));
+        ForgetBatchKernel(S->Interner.intern(T.Profile->Name));
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool> BatchMode("batch",
+    cl::desc("Non-interactive run: no prompts or IR echo, and definitions are "
+             "packed into shared modules instead of one module per def"));
+
+static cl::opt<unsigned> BatchChunkSize("batch-chunk",
+    cl::desc("Definitions per module in -batch mode (0 = no limit)"),
+    cl::init(0));
+
+static cl::opt<bool> HotSwap("hot-swap",
+    cl::desc("Call functions through stubs so a def can be redefined, "
+             "replacing the function for existing callers"));
+
+static cl::opt<unsigned> MemoSize("memo-size",
+    cl::desc("Entries in the memo table of each pure function, rounded up to "
+             "a power of two (0 = don't memoize)"),
+    cl::init(4096));
+
+// Accepts 0 to 3 only, so a level like -O4 or -Ox is an error rather than -O2
+struct OptLevelParser : cl::parser<unsigned> {
+    using cl::parser<unsigned>::parser;
+
+    bool parse(cl::Option& O, StringRef, StringRef Arg, unsigned& Val) {
+        if (Arg.getAsInteger(10, Val) || Val > 3)
+            return O.error("invalid optimization level '-O" + Arg + "'");
+        return false;
+    }
+};
+
+static cl::opt<unsigned, false, OptLevelParser> OptLevel("O",
+    cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+    cl::Prefix, cl::ZeroOrMore, cl::init(2));
+
+static cl::opt<bool> FastMath("fast-math",
+    cl::desc("Let the optimizer reassociate floating-point math, contract "
+             "multiply-adds into FMAs and assume there are no NaNs or "
+             "infinities"));
+
+static cl::opt<bool> DebugInfo("g",
+    cl::desc("Emit line tables mapping generated code back to the source, for "
+             "profilers and debuggers"));
+
+static OptimizationLevel getOptimizationLevel() {
+    switch (S->Opts.OptLevel) {
+    case 0: return OptimizationLevel::O0;
+    case 1: return OptimizationLevel::O1;
+    case 3: return OptimizationLevel::O3;
+    default: return OptimizationLevel::O2;
+    }
+}
+
+// Print the session's pass timings, aggregated across every OptimizeModule
+// call, then those of the (legacy PM) backend when LLVM's -time-passes is
+// given.
+static void ReportPassTimings() {
+    if (!S->PassTimer)
+        return;
+    S->PassTimer.reset();
+    reportAndResetTimings(&errs());
+}
+
+static cl::opt<unsigned> InlineImportLimit("inline-import-limit",
+    cl::desc("Copy optimized definitions of at most this many instructions "
+             "into later modules as available_externally bodies, so they can "
+             "be inlined across modules (0 = off)"),
+    cl::init(100));
+
+// Keep a copy of F's body, named Name, for ImportInlineCandidates.
+static void SnapshotForInlining(Function& F, StringRef Name) {
+    SmallVector<char, 0> Bitcode;
+    if (!CloneFunctionToBitcode(F, Name, Function::AvailableExternallyLinkage, Bitcode))
+        return;
+    std::lock_guard<std::mutex> Lock(S->InlineCandidatesMutex);
+    S->InlineCandidates[Name] = std::move(Bitcode);
+}
+
+// Snapshot the small definitions of a freshly optimized module. Functions
+// named with a leading "__" are the driver's own top-level expressions.
+static void SnapshotModuleForInlining(Module& M) {
+    if (!S->Opts.InlineImportLimit || S->Opts.OptLevel == 0 || S->AOTTarget)
+        return;
+    // Bodies behind a stub are named <name>.v<version>, and a '.' can't
+    // appear in a Kaleidoscope identifier. Only profile-guided recompiles are
+    // kept, under the public name; instrumented bodies are left out.
+    bool Recompiled = M.getModuleFlag("kaleidoscope.pgo");
+    for (auto& F : M) {
+        if (F.isDeclarationForLinker() || F.getName().startswith("__") ||
+            F.getInstructionCount() > S->Opts.InlineImportLimit)
+            continue;
+        StringRef Name = F.getName();
+        if (Recompiled)
+            Name = Name.take_until([](char C) { return C == '.'; });
+        else if (Name.contains('.'))
+            continue;
+        SnapshotForInlining(F, Name);
+    }
+}
+
+// A function is getting a new body; its old snapshot no longer applies.
+static void ForgetInlineCandidate(SymbolID Name) {
+    std::lock_guard<std::mutex> Lock(S->InlineCandidatesMutex);
+    S->InlineCandidates.erase(S->Interner.getName(Name));
+}
+
+// Give M available_externally copies of the earlier definitions it calls so
+// the optimizer can inline them. The copies are already optimized, including
+// whatever they inlined themselves, so only direct callees are imported. They
+// are dropped before code generation.
+static void ImportInlineCandidates(Module& M) {
+    if (!S->Opts.InlineImportLimit)
+        return;
+    PhaseTimer Timer(PH_Codegen);
+
+    SmallVector<std::unique_ptr<MemoryBuffer>, 8> Imports;
+    {
+        std::lock_guard<std::mutex> Lock(S->InlineCandidatesMutex);
+        if (S->InlineCandidates.empty())
+            return;
+        for (auto& F : M) {
+            if (!F.isDeclaration())
+                continue;
+            auto It = S->InlineCandidates.find(F.getName());
+            if (It != S->InlineCandidates.end())
+                Imports.push_back(MemoryBuffer::getMemBufferCopy(
+                    StringRef(It->second.data(), It->second.size()), F.getName()));
+        }
+    }
+
+    for (auto& Bitcode : Imports) {
+        auto Copy = ExitOnErr(parseBitcodeFile(*Bitcode, M.getContext()));
+        Linker::linkModules(M, std::move(Copy));
+    }
+}
+
+// Whether the vectorizers may call glibc's vector math library (libmvec) for
+// whole vectors of sin, exp, ... Its results can be off by a few ulps, so only
+// with -fast-math. The library is loaded into the process for the JIT; -link
+// gets it through -lm.
+static bool UseVectorMathLibrary(const Triple& TT) {
+    if (!S->Opts.FastMath || TT.getArch() != Triple::x86_64 || !TT.isOSLinux() ||
+        !TT.isGNUEnvironment())
+        return false;
+    static bool Loaded =
+        !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+    return Loaded;
+}
+
+// Run the new pass manager's default -O pipeline over a whole module. Besides
+// the per-function simplifications this includes the module passes (inlining,
+// IPSCCP, function attribute inference, ...), so it pays to hand it many
+// definitions at once. Called on whichever thread compiles the module.
+static void OptimizeModule(Module& M, TargetMachine* TM) {
+    PhaseTimer Timer(PH_Optimize, /*ForCurrentItem=*/!S->DeferOptimization);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassInstrumentationCallbacks PIC;
+    if (S->PassTimer)
+        S->PassTimer->registerCallbacks(PIC);
+
+    // Takes the place of PassBuilder's default library info, which is built
+    // from the module's triple (unset for the JIT) and has no vector library
+    Triple TT = TM ? TM->getTargetTriple() : Triple(M.getTargetTriple());
+    TargetLibraryInfoImpl TLII(TT);
+    if (UseVectorMathLibrary(TT)) {
+        TLII.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+        FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+    }
+
+    PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // Profile-guided recompiles get the full pipeline
+    OptimizationLevel Level = M.getModuleFlag("kaleidoscope.pgo")
+        ? OptimizationLevel::O3 : getOptimizationLevel();
+    ModulePassManager MPM = Level == OptimizationLevel::O0
+        ? PB.buildO0DefaultPipeline(Level)
+        : PB.buildPerModuleDefaultPipeline(Level);
+    // Locals live in allocas until mem2reg; the -O1 and up pipelines run it
+    // as part of SROA
+    if (Level == OptimizationLevel::O0)
+        MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+    MPM.run(M, MAM);
+
+    SnapshotModuleForInlining(M);
+}
+
+static void InitializeModule() {
+    // Open a new context and module.
+    S->TheContext = std::make_unique<LLVMContext>();
+    S->TheModule = std::make_unique<Module>("my cool jit", *S->TheContext);
+    if (S->AOTTarget) {
+        S->TheModule->setTargetTriple(S->AOTTarget->getTargetTriple().str());
+        S->TheModule->setDataLayout(S->AOTTarget->createDataLayout());
+    }
+    else {
+        S->TheModule->setDataLayout(S->TheJIT->getDataLayout());
+    }
+
+    // Create a new builder for the module.
+    S->Builder = std::make_unique<IRBuilder<>>(*S->TheContext);
+    if (S->Opts.FastMath) {
+        FastMathFlags FMF;
+        FMF.setFast();
+        S->Builder->setFastMathFlags(FMF);
+    }
+
+    // With -g, each module is a compile unit of its own, with line tables only
+    S->DBuilder.reset();
+    if (S->Opts.DebugInfo) {
+        S->TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+            DEBUG_METADATA_VERSION);
+        S->DBuilder = std::make_unique<DIBuilder>(*S->TheModule);
+        SmallString<256> Path(S->Src.Name);
+        sys::fs::make_absolute(Path);
+        S->DebugFile = S->DBuilder->createFile(sys::path::filename(Path),
+            sys::path::parent_path(Path));
+        S->DBuilder->createCompileUnit(dwarf::DW_LANG_C, S->DebugFile,
+            "Kaleidoscope", S->Opts.OptLevel != 0, "", 0, "",
+            DICompileUnit::LineTablesOnly);
+    }
+}
+
+// Hand the definitions accumulated in TheModule to the JIT as one module.
+static void FlushPendingDefinitions() {
+    if (!S->PendingDefs || S->AOTTarget)
+        return;
+    if (S->DeferOptimization)
+        ImportInlineCandidates(*S->TheModule);
+    ExitOnErr(TimePhase(PH_AddModule, [] {
+        return S->TheJIT->addModule(
+            ThreadSafeModule(std::move(S->TheModule), std::move(S->TheContext)));
+    }));
+    InitializeModule();
+    S->PendingDefs = 0;
+}
+
+// Hand a freshly codegen'd definition to the JIT in a module of its own. The
+// body moves to a per-version name and every call to the function, recursive
+// ones included, goes through the public name, which is the JIT's stub.
+static void AddSwappableDefinition(Function& F, unsigned Version) {
+    std::string Name = F.getName().str();
+    std::string ImplName = (Name + ".v" + Twine(Version)).str();
+    F.setName(ImplName);
+    Function* Stub = Function::Create(F.getFunctionType(),
+        Function::ExternalLinkage, Name, F.getParent());
+    F.replaceAllUsesWith(Stub);
+
+    ExitOnErr(TimePhase(PH_AddModule, [&] {
+        return S->TheJIT->addSwappableFunction(
+            ThreadSafeModule(std::move(S->TheModule), std::move(S->TheContext)),
+            Name, ImplName);
+    }));
+    InitializeModule();
+}
+
+// Pure definitions (pure def ...) are memoized, unless -memo-size=0
+static void HandleDefinition(bool Pure = false) {
+    if (auto FnAST = TimeParse(ParseDefinition)) {
+        NoteItemName(FnAST->getSymbol());
+        // Without stubs to repoint, a second body would clash in the JIT
+        bool Redefinition = S->FunctionVersions.count(FnAST->getSymbol());
+        if (Redefinition && !(S->TheJIT && S->Opts.HotSwap)) {
+            LogError("Function cannot be redefined");
+            S->ASTArena.Reset();
+            return;
+        }
+        if (Pure && !CheckPure(*FnAST)) {
+            S->ASTArena.Reset();
+            return;
+        }
+        bool Memoize = Pure && S->Opts.MemoSize;
+        if (auto* FnIR = TimePhase(PH_Codegen, [&] { return FnAST->codegen(); })) {
+            // The old body may have been memoized, or called by memoized ones
+            if (Redefinition)
+                ResetMemoTables(FnAST->getSymbol());
+            if (Memoize)
+                FnIR = MemoizeFunction(*FnIR, S->FunctionVersions[FnAST->getSymbol()]);
+            if (S->Opts.TierThreshold)
+                if (auto* TF = getTieredFunction(FnAST->getSymbol())) {
+                    // Only compiled code shares the memo table
+                    if (Memoize)
+                        TF->Code.clear();
+                    else
+                        TimePhase(PH_Codegen, [&] { return FnAST->lower(*TF); });
+                }
+            InvalidateCachedExprs(FnAST->getSymbol());
+            ForgetInlineCandidate(FnAST->getSymbol());
+            ForgetBatchKernel(FnAST->getSymbol());
+            NoteCallees(*FnAST);
+            if (S->Opts.PGOThreshold && S->TheJIT) {
+                // Counters would only see the misses
+                if (Memoize) {
+                    std::lock_guard<std::mutex> Lock(S->ProfileMutex);
+                    S->ProfiledByName.erase(FnIR->getName());
+                }
+                else
+                    InstrumentForProfile(*FnIR, S->FunctionVersions[FnAST->getSymbol()]);
+            }
+            if (!S->DeferOptimization) {
+                ImportInlineCandidates(*S->TheModule);
+                OptimizeModule(*S->TheModule, S->TheTargetMachine.get());
+            }
+            if (!S->Opts.Batch) {
+                fprintf(stderr, "Read function definition:");
+                FnIR->print(errs());
+                // Unless the optimizer has inlined it into FnIR
+                if (Memoize)
+                    if (auto* Body = S->TheModule->getFunction((FnIR->getName() +
+                            ".pure.v" + Twine(S->FunctionVersions[FnAST->getSymbol()])).str()))
+                        Body->print(errs());
+                fprintf(stderr, "\n");
+            }
+            if (S->TheJIT && S->TheJIT->isHotSwap()) {
+                AddSwappableDefinition(*FnIR, S->FunctionVersions[FnAST->getSymbol()]);
+            }
+            else {
+                ++S->PendingDefs;
+                if (!S->Opts.Batch || S->PendingDefs == S->Opts.BatchChunkSize)
+                    FlushPendingDefinitions();
+            }
+        }
+    }
+    else {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+
+    // Release the definition's AST nodes in one go
+    S->ASTArena.Reset();
+}
+
+static void HandleExtern() {
+    if (auto ProtoAST = TimeParse(ParseExtern)) {
+        NoteItemName(ProtoAST->getSymbol());
+        if (auto* FnIR = TimePhase(PH_Codegen, [&] { return ProtoAST->codegen(); })) {
+            if (!S->Opts.Batch) {
+                fprintf(stderr, "Read extern: ");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
+            S->FunctionProtos[ProtoAST->getSymbol()] = std::move(ProtoAST);
+            S->CalleeEffects.clear();
+        }
+    }
+    else {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+// Run count of a top-level expression seen with -tier-threshold. It stays at
+// TierThreshold once reached, so a hot expression keeps going to the JIT.
+struct TieredExpr {
+    std::string Key;
+    unsigned Runs;
+};
+
+// Expressions whose runs are counted at once. Most in generated scripts run
+// once, so the table forgets those run longest ago.
+static const size_t MaxTieredExprs = 4096;
+
+// Run a top-level expression in the interpreter. Returns false if it can't be
+// interpreted or has become hot, leaving it to the JIT.
+static bool RunTieredExpression(FunctionAST& FnAST) {
+    TieredFunction Expr;
+    Expr.Name = FnAST.getSymbol();
+    Expr.NumArgs = 0;
+    if (!TimePhase(PH_Codegen, [&] { return FnAST.lower(Expr); }))
+        return false;
+
+    StringRef Key((const char*)Expr.Code.data(), Expr.Code.size() * sizeof(uint64_t));
+    auto It = S->TieredExprIndex.find(Key);
+    if (It != S->TieredExprIndex.end()) {
+        S->TieredExprLRU.splice(S->TieredExprLRU.begin(), S->TieredExprLRU, It->second);
+    }
+    else {
+        if (S->TieredExprLRU.size() == MaxTieredExprs) {
+            S->TieredExprIndex.erase(S->TieredExprLRU.back().Key);
+            S->TieredExprLRU.pop_back();
+        }
+        S->TieredExprLRU.push_front({ Key.str(), 0 });
+        S->TieredExprIndex[Key] = S->TieredExprLRU.begin();
+    }
+    unsigned& Runs = S->TieredExprLRU.front().Runs;
+    if (Runs == S->Opts.TierThreshold || ++Runs == S->Opts.TierThreshold)
+        return false;
+
+    double Result = TimePhase(PH_Execute, [&] { return Interpret(Expr, 0); });
+    fprintf(stderr, "Evaluated to %f\n", Result);
+    return true;
+}
+
+static void HandleTopLevelExpression() {
+    // Evaluate a top-level expression into an annonymous function
+    if (auto FnAST = TimeParse(ParseTopLevelExpr)) {
+        NoteItemName(FnAST->getSymbol());
+
+        ExprKey Key;
+        if (S->Opts.ExprCacheSize || S->ExprThreadPool)
+            FnAST->profile(Key);
+        if (S->ExprThreadPool && IsIndependent(Key)) {
+            HoldExpression(*FnAST, Key);
+            S->ASTArena.Reset();
+            return;
+        }
+        // It may depend on the effects of the ones held back, so run those
+        FlushExprRun();
+
+        if (S->Opts.ExprCacheSize) {
+            if (auto* FP = LookupCachedExpr(Key)) {
+                double Result = TimePhase(PH_Execute, FP);
+                fprintf(stderr, "Evaluated to %f\n", Result);
+                S->ASTArena.Reset();
+                return;
+            }
+        }
+
+        if (S->Opts.TierThreshold && RunTieredExpression(*FnAST)) {
+            S->ASTArena.Reset();
+            return;
+        }
+
+        // The expression may call definitions still sitting in TheModule, and
+        // its own module is thrown away after running, so flush those first.
+        FlushPendingDefinitions();
+
+        if (auto* FnIR = TimePhase(PH_Codegen, [&] { return FnAST->codegen(); })) {
+            // Cached expressions stay in the JIT, so each needs its own name
+            std::string Name = "__anon_expr";
+            if (S->Opts.ExprCacheSize) {
+                Name = ("__cached_expr." + Twine(S->NumCachedExprs++)).str();
+                FnIR->setName(Name);
+            }
+
+            ImportInlineCandidates(*S->TheModule);
+            if (!S->DeferOptimization)
+                OptimizeModule(*S->TheModule, S->TheTargetMachine.get());
+
+            // Create a ResourceTracker to track JIT'd memory allocated to our
+            // anonymous expression -- that way we can free it after executing,
+            // or when it is evicted from the expression cache.
+            auto RT = S->TheJIT->getMainJITDylib().createResourceTracker();
+
+            auto TSM = ThreadSafeModule(std::move(S->TheModule), std::move(S->TheContext));
+            ExitOnErr(TimePhase(PH_AddModule, [&] {
+                return S->TheJIT->addModule(std::move(TSM), RT);
+            }));
+            InitializeModule(); 
+            
+            // Search the JIT for the expression's symbol
+            auto ExprSymbol = ExitOnErr(TimePhase(PH_Lookup, [&] {
+                return S->TheJIT->lookup(Name);
+            }));
+
+            // Get the symbol's address and cast it to the right type (takes no
+            // arguments, returns a double) so we can call it as a native function.
+            double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+            double Result = TimePhase(PH_Execute, FP);
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+            // Keep the expression for next time, or delete its module from the JIT
+            if (S->Opts.ExprCacheSize)
+                InsertCachedExpr(Key, std::move(RT), FP);
+            else
+                ExitOnErr(S->TheJIT->removeModule(std::move(RT)));
+        }
+    }
+    else {
+        getNextToken();
+    }
+
+    S->ASTArena.Reset();
+}
+
+// AOT counterpart of HandleTopLevelExpression: the expression stays in the
+// module under a unique name and is called from the generated main.
+static void HandleTopLevelExpressionAOT() {
+    if (auto FnAST = TimeParse(ParseTopLevelExpr)) {
+        NoteItemName(FnAST->getSymbol());
+        if (auto* FnIR = TimePhase(PH_Codegen, [&] { return FnAST->codegen(); })) {
+            FnIR->setName("__anon_expr." + Twine(S->AOTExprs.size()));
+            S->AOTExprs.push_back(FnIR);
+        }
+    }
+    else {
+        getNextToken();
+    }
+
+    S->ASTArena.Reset();
+}
+
+static void HandleMap();
+
+static void MainLoop() {
+    while (true) {
+        FlushOutput();
+        S->ExprLines.clear();
+        if (S->Opts.PGOThreshold)
+            ApplyTierUps();
+        if (!S->Opts.Batch)
+            fprintf(stderr, "ready> ");
+        // Anything but another expression ends a run of held-back ones
+        if (S->CurTok == tok_eof || S->CurTok == tok_def || S->CurTok == tok_pure ||
+            S->CurTok == tok_extern || S->CurTok == tok_map)
+            FlushExprRun();
+        switch (S->CurTok) {
+        case tok_eof:
+            FlushPendingDefinitions();
+            return;
+        case ';': 
+            getNextToken();
+            break;
+        case tok_def:
+            BeginItem('d');
+            HandleDefinition();
+            EndItem();
+            break;
+        case tok_pure:
+            BeginItem('d');
+            getNextToken(); // eat pure.
+            if (S->CurTok == tok_def)
+                HandleDefinition(/*Pure=*/true);
+            else
+                LogError("Expected 'def' after 'pure'");
+            EndItem();
+            break;
+        case tok_extern:
+            BeginItem('e');
+            HandleExtern();
+            EndItem();
+            break;
+        case tok_map:
+            BeginItem('x');
+            HandleMap();
+            EndItem();
+            break;
+        default:
+            BeginItem('x');
+            if (S->AOTTarget)
+                HandleTopLevelExpressionAOT();
+            else
+                HandleTopLevelExpression();
+            EndItem();
+            break;
+        }
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Batch Evaluation
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned> MapThreads("map-threads",
+    cl::desc("Split batch evaluation (map) across N threads (0 = one per core)"),
+    cl::init(1));
+
+// Smaller slices of rows aren't worth handing to another thread
+static const size_t MinRowsPerTask = 1 << 16;
+
+// Compiled from a function f of N doubles. Sets Out[I] to
+// f(Cols[0][I], ..., Cols[N-1][I]) for each row I in [Begin, End).
+using BatchKernelFn = void (*)(const double* const* Cols, double* Out,
+    uint64_t Begin, uint64_t End);
+
+struct BatchKernel {
+    BatchKernelFn Run;
+    ResourceTrackerSP RT;
+};
+
+// Free a function's kernel once it gets a new body, so the next batch inlines
+// that instead.
+static void ForgetBatchKernel(SymbolID Name) {
+    auto It = S->BatchKernels.find(Name);
+    if (It == S->BatchKernels.end())
+        return;
+    ExitOnErr(S->TheJIT->removeModule(std::move(It->second.RT)));
+    S->BatchKernels.erase(It);
+}
+
+// Emit the kernel for P's function into TheModule: a counted loop doing one
+// load per column, the call and a store per row. The column pointers are
+// loaded once up front, so the loop body only indexes plain arrays.
+static Function* CodegenBatchKernel(PrototypeAST& P, StringRef Name) {
+    Function* F = getFunction(P.getSymbol());
+    Type* DoubleTy = S->Builder->getDoubleTy();
+    Type* DoublePtrTy = DoubleTy->getPointerTo();
+    Type* Int64Ty = S->Builder->getInt64Ty();
+    FunctionType* FT = FunctionType::get(S->Builder->getVoidTy(),
+        { DoublePtrTy->getPointerTo(), DoublePtrTy, Int64Ty, Int64Ty }, false);
+    Function* Kernel = Function::Create(FT, Function::ExternalLinkage, Name,
+        S->TheModule.get());
+    auto Arg = Kernel->arg_begin();
+    Value* Cols = &*Arg++;
+    Value* Out = &*Arg++;
+    Value* Begin = &*Arg++;
+    Value* End = &*Arg;
+    Cols->setName("cols");
+    Out->setName("out");
+    Begin->setName("begin");
+    End->setName("end");
+
+    BasicBlock* EntryBB = BasicBlock::Create(*S->TheContext, "entry", Kernel);
+    BasicBlock* LoopBB = BasicBlock::Create(*S->TheContext, "loop", Kernel);
+    BasicBlock* ExitBB = BasicBlock::Create(*S->TheContext, "exit", Kernel);
+
+    S->Builder->SetInsertPoint(EntryBB);
+    SmallVector<Value*, 8> Columns;
+    for (unsigned I = 0, E = F->arg_size(); I != E; ++I)
+        Columns.push_back(S->Builder->CreateLoad(DoublePtrTy,
+            S->Builder->CreateConstInBoundsGEP1_64(DoublePtrTy, Cols, I), "col"));
+    S->Builder->CreateCondBr(S->Builder->CreateICmpULT(Begin, End), LoopBB, ExitBB);
+
+    S->Builder->SetInsertPoint(LoopBB);
+    PHINode* Row = S->Builder->CreatePHI(Int64Ty, 2, "row");
+    Row->addIncoming(Begin, EntryBB);
+    SmallVector<Value*, 8> Args;
+    for (Value* Column : Columns)
+        Args.push_back(S->Builder->CreateLoad(DoubleTy,
+            S->Builder->CreateInBoundsGEP(DoubleTy, Column, Row)));
+    S->Builder->CreateStore(S->Builder->CreateCall(F, Args),
+        S->Builder->CreateInBoundsGEP(DoubleTy, Out, Row));
+    Value* Next = S->Builder->CreateNUWAdd(Row, S->Builder->getInt64(1), "row.next");
+    Row->addIncoming(Next, LoopBB);
+    S->Builder->CreateCondBr(S->Builder->CreateICmpULT(Next, End), LoopBB, ExitBB);
+
+    S->Builder->SetInsertPoint(ExitBB);
+    S->Builder->CreateRetVoid();
+
+    verifyFunction(*Kernel);
+    return Kernel;
+}
+
+// Compile (or reuse) the kernel for P's function. Its optimized body is
+// imported like for any other caller and forced inline, so the loop
+// vectorizer sees the whole computation of a row.
+static BatchKernel& GetBatchKernel(PrototypeAST& P) {
+    auto It = S->BatchKernels.find(P.getSymbol());
+    if (It != S->BatchKernels.end())
+        return It->second;
+
+    // The function may still be sitting in TheModule
+    FlushPendingDefinitions();
+
+    StringRef FnName = S->Interner.getName(P.getSymbol());
+    std::string Name = ("__map." + FnName).str();
+    TimePhase(PH_Codegen, [&] { return CodegenBatchKernel(P, Name); });
+    ImportInlineCandidates(*S->TheModule);
+    if (auto* F = S->TheModule->getFunction(FnName))
+        if (!F->isDeclaration())
+            F->addFnAttr(Attribute::AlwaysInline);
+    if (!S->DeferOptimization)
+        OptimizeModule(*S->TheModule, S->TheTargetMachine.get());
+
+    auto RT = S->TheJIT->getMainJITDylib().createResourceTracker();
+    auto TSM = ThreadSafeModule(std::move(S->TheModule), std::move(S->TheContext));
+    ExitOnErr(TimePhase(PH_AddModule, [&] {
+        return S->TheJIT->addModule(std::move(TSM), RT);
+    }));
+    InitializeModule();
+
+    auto Sym = ExitOnErr(TimePhase(PH_Lookup, [&] { return S->TheJIT->lookup(Name); }));
+    auto& Kernel = S->BatchKernels[P.getSymbol()];
+    Kernel.Run = (BatchKernelFn)(intptr_t)Sym.getAddress();
+    Kernel.RT = std::move(RT);
+    return Kernel;
+}
+
+/// EvaluateBatch - Apply function Name to Rows rows, reading its I'th argument
+/// from Columns[I] and writing the results to Out. The buffers are the
+/// caller's and are used in place; Out may be one of the columns. The rows
+/// are split across -map-threads threads, so a function with side effects
+/// sees them in no particular order. Returns false (after logging why) if Name
+/// can't be applied to the columns.
+static bool EvaluateBatch(SymbolID Name, ArrayRef<const double*> Columns,
+    double* Out, size_t Rows) {
+    auto PI = S->FunctionProtos.find(Name);
+    if (PI == S->FunctionProtos.end()) {
+        LogError("Unknown function referenced");
+        return false;
+    }
+    if (!PI->second->isScalar()) {
+        LogError("map needs a function of doubles that returns a double");
+        return false;
+    }
+    if (PI->second->getArgs().size() != Columns.size()) {
+        LogError("Incorrect # arguments passed");
+        return false;
+    }
+
+    BatchKernel& Kernel = GetBatchKernel(*PI->second);
+    BatchKernelFn Run = Kernel.Run;
+    const double* const* Cols = Columns.data();
+
+    PhaseTimer Timer(PH_Execute);
+    size_t NumTasks = 1;
+    if (S->MapThreadPool)
+        NumTasks = std::min<size_t>(S->MapThreadPool->getThreadCount(),
+            Rows / MinRowsPerTask);
+    if (NumTasks <= 1) {
+        Run(Cols, Out, 0, Rows);
+        return true;
+    }
+    size_t RowsPerTask = (Rows + NumTasks - 1) / NumTasks;
+    for (size_t Begin = 0; Begin < Rows; Begin += RowsPerTask) {
+        size_t End = std::min(Rows, Begin + RowsPerTask);
+        S->MapThreadPool->async([=] {
+            Run(Cols, Out, Begin, End);
+            FlushOutput();
+        });
+    }
+    S->MapThreadPool->wait();
+    return true;
+}
+
+// Most rows a map may ask for. The argument column and the results take 16
+// bytes a row, 4 GiB at this limit.
+static const uint64_t MaxMapRows = 1 << 28;
+
+// map f N - Apply f to N rows and print the sum of the results. Every
+// parameter reads the same column, which holds the row numbers 0..N-1.
+static void HandleMap() {
+    getNextToken(); // eat map.
+    if (S->CurTok != tok_identifier) {
+        LogError("Expected function name after map");
+        getNextToken();
+        return;
+    }
+    SymbolID Name = S->Interner.intern(S->IdentifierStr);
+    NoteItemName(Name);
+    getNextToken(); // eat function name.
+    // Range first: converting a double beyond uint64_t is undefined
+    if (S->CurTok != tok_number || !(S->NumVal >= 0 && S->NumVal <= MaxMapRows) ||
+        S->NumVal != (double)(uint64_t)S->NumVal) {
+        LogError(S->CurTok == tok_number && S->NumVal > MaxMapRows ?
+            "Row count too large for map" : "Expected row count after function name");
+        getNextToken();
+        return;
+    }
+    size_t Rows = (size_t)S->NumVal;
+    getNextToken(); // eat row count.
+
+    auto PI = S->FunctionProtos.find(Name);
+    if (PI == S->FunctionProtos.end()) {
+        LogError("Unknown function referenced");
+        return;
+    }
+    std::vector<double> Column(Rows), Results(Rows);
+    for (size_t I = 0; I != Rows; ++I)
+        Column[I] = (double)I;
+    SmallVector<const double*, 8> Columns(PI->second->getArgs().size(),
+        Column.data());
+    if (!EvaluateBatch(Name, Columns, Results.data(), Rows))
+        return;
+
+    double Sum = 0;
+    for (double R : Results)
+        Sum += R;
+    fprintf(stderr, "Mapped %s over %zu rows, sum %f\n",
+        S->Interner.getName(Name).str().c_str(), Rows, Sum);
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel Expressions
+//===----------------------------------------------------------------------===//
+
+static cl::opt<unsigned> ExprThreads("expr-threads",
+    cl::desc("With -batch, run independent top-level expressions together on "
+             "N threads (0 = one per core)"),
+    cl::init(1));
+
+// Longest run of expressions held back before it is compiled and run anyway
+static const size_t MaxExprRun = 1024;
+
+// A top-level expression held back in ExprRun: compiled into TheModule under
+// Name, or already compiled (an expression cache hit) at Native. An entry
+// with neither is a message reported while the run was being collected,
+// printed in its place.
+struct PendingExpr {
+    std::string Name;
+    double (*Native)() = nullptr;
+    double Result = 0;
+    std::string Message;
+};
+
+// Remember which functions FnAST's body calls and what the body does itself,
+// and forget what was known about side effects, which the new body may
+// change.
+static void NoteCallees(FunctionAST& FnAST) {
+    ExprKey Body;
+    FnAST.profile(Body);
+    S->FunctionCallees[FnAST.getSymbol()] = std::move(Body.Callees);
+    S->FunctionEffects[FnAST.getSymbol()] = Body.Effects;
+    S->CalleeEffects.clear();
+}
+
+// The EffectBits of a call to Name: those of every body it can reach. A
+// function without a known body is native code declared with extern, such
+// as printd, that we know nothing about.
+static unsigned GetCallEffects(SymbolID Name) {
+    auto Known = S->CalleeEffects.find(Name);
+    if (Known != S->CalleeEffects.end())
+        return Known->second;
+
+    unsigned Effects = 0;
+    SmallVector<SymbolID, 16> Worklist = { Name };
+    DenseSet<SymbolID> Seen = { Name };
+    while (!(Effects & EF_Native) && !Worklist.empty()) {
+        SymbolID F = Worklist.pop_back_val();
+        StringRef FName = S->Interner.getName(F);
+        if (isBuiltin(FName)) {
+            if (isOutputBuiltin(FName))
+                Effects |= EF_Native;
+            continue;
+        }
+        auto It = S->FunctionCallees.find(F);
+        if (It == S->FunctionCallees.end()) {
+            Effects |= EF_Native;
+            break;
+        }
+        Effects |= S->FunctionEffects.lookup(F);
+        for (SymbolID Callee : It->second)
+            if (Seen.insert(Callee).second)
+                Worklist.push_back(Callee);
+    }
+    return S->CalleeEffects[Name] = Effects;
+}
+
+// Whether a call to Name may do anything besides computing its result
+static bool MayHaveEffects(SymbolID Name) {
+    return GetCallEffects(Name) & ~EF_ReadsMemory;
+}
+
+// An expression is independent of the others around it if all it does is
+// compute its result, so any number of them can run at once, in any order.
+// Reading arrays is fine, since the ones that write them aren't held back.
+static bool IsIndependent(const ExprKey& Key) {
+    return !(Key.Effects & ~EF_ReadsMemory) && none_of(Key.Callees, MayHaveEffects);
+}
+
+// Queue Message behind the expressions held back, if there are any, so it
+// comes out in order with their results. Returns false if it should be
+// printed now.
+static bool HoldMessage(std::string Message) {
+    if (S->ExprRun.empty())
+        return false;
+    S->ExprRun.emplace_back();
+    S->ExprRun.back().Message = std::move(Message);
+    return true;
+}
+
+// Add an independent expression to the run. Its function goes into TheModule
+// with the others', to be compiled with them by FlushExprRun, unless the same
+// expression is already cached or in the run.
+static void HoldExpression(FunctionAST& FnAST, const ExprKey& Key) {
+    PendingExpr Expr;
+    if (S->Opts.ExprCacheSize)
+        Expr.Native = LookupCachedExpr(Key);
+    auto Same = S->ExprRunIndex.find(Key.getBytes());
+    if (!Expr.Native && Same != S->ExprRunIndex.end())
+        Expr.Name = S->ExprRun[Same->second].Name;
+    else if (!Expr.Native) {
+        // Earlier definitions still in TheModule go to the JIT on their own
+        FlushPendingDefinitions();
+        auto* FnIR = TimePhase(PH_Codegen, [&] { return FnAST.codegen(); });
+        if (!FnIR)
+            return;
+        Expr.Name = ("__expr_run." + Twine(S->ExprRun.size())).str();
+        FnIR->setName(Expr.Name);
+        S->ExprRunIndex[Key.getBytes()] = S->ExprRun.size();
+    }
+    S->ExprRun.push_back(std::move(Expr));
+    if (S->ExprRun.size() == MaxExprRun)
+        FlushExprRun();
+}
+
+// Compile the expressions held back as one module, run them across
+// ExprThreadPool and print their results in source order. Each thread takes
+// the next expression not yet started, so long ones don't hold up the rest.
+// The module is freed afterwards; these expressions aren't cached, since
+// they share its resource tracker.
+static void FlushExprRun() {
+    if (S->ExprRun.empty())
+        return;
+    std::vector<PendingExpr> Run = std::move(S->ExprRun);
+    S->ExprRun.clear();
+    S->ExprRunIndex.clear();
+
+    ResourceTrackerSP RT;
+    if (any_of(Run, [](const PendingExpr& E) { return !E.Name.empty(); })) {
+        ImportInlineCandidates(*S->TheModule);
+        if (!S->DeferOptimization)
+            OptimizeModule(*S->TheModule, S->TheTargetMachine.get());
+        RT = S->TheJIT->getMainJITDylib().createResourceTracker();
+        auto TSM = ThreadSafeModule(std::move(S->TheModule), std::move(S->TheContext));
+        ExitOnErr(TimePhase(PH_AddModule, [&] {
+            return S->TheJIT->addModule(std::move(TSM), RT);
+        }));
+        InitializeModule();
+
+        StringMap<double (*)()> Compiled;
+        for (auto& Expr : Run) {
+            if (Expr.Name.empty())
+                continue;
+            auto& FP = Compiled[Expr.Name];
+            if (!FP) {
+                auto Sym = ExitOnErr(TimePhase(PH_Lookup, [&] {
+                    return S->TheJIT->lookup(Expr.Name);
+                }));
+                FP = (double (*)())(intptr_t)Sym.getAddress();
+            }
+            Expr.Native = FP;
+        }
+    }
+
+    {
+        PhaseTimer Timer(PH_Execute);
+        std::atomic<size_t> Next(0);
+        auto RunExprs = [&] {
+            for (size_t I; (I = Next++) < Run.size();)
+                if (Run[I].Native)
+                    Run[I].Result = Run[I].Native();
+        };
+        size_t NumTasks = std::min<size_t>(S->ExprThreadPool->getThreadCount(),
+            Run.size());
+        for (size_t I = 0; I != NumTasks; ++I)
+            S->ExprThreadPool->async(RunExprs);
+        S->ExprThreadPool->wait();
+    }
+
+    for (auto& Expr : Run) {
+        if (Expr.Native)
+            fprintf(stderr, "Evaluated to %f\n", Expr.Result);
+        else
+            fputs(Expr.Message.c_str(), stderr);
+    }
+    if (RT)
+        ExitOnErr(S->TheJIT->removeModule(std::move(RT)));
+}
+
+//===----------------------------------------------------------------------===//
+// Memoization
+//===----------------------------------------------------------------------===//
+
+// Slots an argument tuple may occupy, starting at the one it hashes to
+static const unsigned MemoProbes = 4;
+
+// A pure function's JIT'd table, named so it can be looked up and cleared
+struct MemoTable {
+    std::string Table;
+    uint64_t Bytes;
+};
+
+// A pure function may only compute its result from its arguments, so a call
+// can be answered from a table of earlier results. Arrays can change between
+// calls, so it can't index them either.
+static bool CheckPure(const FunctionAST& FnAST) {
+    if (!FnAST.getProto()->isScalar()) {
+        LogError("Pure functions must take and return doubles");
+        return false;
+    }
+    ExprKey Body;
+    FnAST.profile(Body);
+    if (Body.Effects) {
+        LogError("Pure functions cannot index arrays or vectors");
+        return false;
+    }
+    for (SymbolID Callee : Body.Callees)
+        if (Callee != FnAST.getSymbol() && GetCallEffects(Callee)) {
+            LogError("Pure functions cannot call functions that have side "
+                     "effects or index arrays");
+            return false;
+        }
+    return true;
+}
+
+// Called before Redefined gets a new body. Its own table goes with the old
+// code; the others may hold results computed with the old body, so they are
+// zeroed. Nothing JIT'd runs between top-level items, so plain stores do.
+static void ResetMemoTables(SymbolID Redefined) {
+    S->MemoTables.erase(Redefined);
+    for (auto& Entry : S->MemoTables) {
+        auto Sym = ExitOnErr(TimePhase(PH_Lookup, [&] {
+            return S->TheJIT->lookup(Entry.second.Table);
+        }));
+        memset((void*)(intptr_t)Sym.getAddress(), 0, Entry.second.Bytes);
+    }
+}
+
+// Put a memo table in front of F, which keeps its body under a per-version
+// name. Returns the new entry point, which takes over F's name and every call
+// to F, so non-tail recursive calls hit the table too; self tail calls were
+// already compiled as jumps.
+//
+// The table has MemoSize entries of { i64 Seq, [N x i64] Args, i64 Result },
+// with the doubles stored as their bit patterns. Any number of threads may
+// call the function at once (-map-threads, -expr-threads), so each entry is
+// a seqlock: Seq is 0 while the entry is empty, odd while it is being written
+// and even once it holds a result. A reader only trusts an entry whose Seq is
+// even and unchanged across its loads. A writer claims one with a
+// compare-and-swap and gives up if another thread got there first.
+static Function* MemoizeFunction(Function& F, unsigned Version) {
+    LLVMContext& Ctx = *S->TheContext;
+    IRBuilder<>& B = *S->Builder;
+    std::string Name = F.getName().str();
+    F.setName(Name + ".pure.v" + Twine(Version));
+    F.setLinkage(GlobalValue::InternalLinkage);
+    Function* Memo = Function::Create(F.getFunctionType(),
+        Function::ExternalLinkage, Name, S->TheModule.get());
+    F.replaceAllUsesWith(Memo);
+
+    uint64_t NumEntries = PowerOf2Ceil(std::max<uint64_t>(S->Opts.MemoSize, MemoProbes));
+    Type* I64 = B.getInt64Ty();
+    auto* EntryTy = StructType::get(Ctx,
+        { I64, ArrayType::get(I64, F.arg_size()), I64 });
+    auto* TableTy = ArrayType::get(EntryTy, NumEntries);
+    auto* Table = new GlobalVariable(*S->TheModule, TableTy, /*isConstant=*/false,
+        GlobalValue::ExternalLinkage, Constant::getNullValue(TableTy),
+        Name + ".memo.v" + Twine(Version));
+    S->MemoTables[S->Interner.intern(Name)] = { Table->getName().str(),
+        S->TheModule->getDataLayout().getTypeAllocSize(TableTy) };
+
+    auto* Entry = BasicBlock::Create(Ctx, "entry", Memo);
+    auto* Probe = BasicBlock::Create(Ctx, "probe", Memo);
+    auto* Check = BasicBlock::Create(Ctx, "check", Memo);
+    auto* Hit = BasicBlock::Create(Ctx, "hit", Memo);
+    auto* Next = BasicBlock::Create(Ctx, "next", Memo);
+    auto* Evict = BasicBlock::Create(Ctx, "evict", Memo);
+    auto* Miss = BasicBlock::Create(Ctx, "miss", Memo);
+    auto* Claim = BasicBlock::Create(Ctx, "claim", Memo);
+    auto* Store = BasicBlock::Create(Ctx, "store", Memo);
+    auto* Done = BasicBlock::Create(Ctx, "done", Memo);
+    auto SeqPtr = [&](Value* Slot) {
+        return B.CreateInBoundsGEP(TableTy, Table,
+            { B.getInt64(0), Slot, B.getInt32(0) });
+    };
+    auto ArgPtr = [&](Value* Slot, unsigned I) {
+        return B.CreateInBoundsGEP(TableTy, Table,
+            { B.getInt64(0), Slot, B.getInt32(1), B.getInt64(I) });
+    };
+    auto ResultPtr = [&](Value* Slot) {
+        return B.CreateInBoundsGEP(TableTy, Table,
+            { B.getInt64(0), Slot, B.getInt32(2) });
+    };
+    auto AtomicLoad = [&](Value* Ptr, AtomicOrdering Order) {
+        LoadInst* Load = B.CreateLoad(I64, Ptr);
+        Load->setAtomic(Order);
+        return Load;
+    };
+    auto AtomicStore = [&](Value* V, Value* Ptr, AtomicOrdering Order) {
+        B.CreateStore(V, Ptr)->setAtomic(Order);
+    };
+
+    // With -g the lookup gets a subprogram of its own, on the definition's line
+    if (DISubprogram* SP = F.getSubprogram()) {
+        DISubprogram* MemoSP = S->DBuilder->createFunction(S->DebugFile, Name,
+            StringRef(), S->DebugFile, SP->getLine(), SP->getType(), SP->getLine(),
+            DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+        S->DBuilder->finalizeSubprogram(MemoSP);
+        Memo->setSubprogram(MemoSP);
+        B.SetCurrentDebugLocation(DILocation::get(Ctx, SP->getLine(), 0, MemoSP));
+    }
+
+    // Multiplicative hash of the argument bits; the top bits pick the slot
+    B.SetInsertPoint(Entry);
+    SmallVector<Value*, 8> Args, Keys;
+    Value* Hash = B.getInt64(0);
+    for (auto& Arg : Memo->args()) {
+        Args.push_back(&Arg);
+        Keys.push_back(B.CreateBitCast(&Arg, I64));
+        Hash = B.CreateMul(B.CreateXor(Hash, Keys.back()),
+            B.getInt64(0x9E3779B97F4A7C15ULL));
+    }
+    Value* Home = B.CreateLShr(Hash, 64 - Log2_64(NumEntries));
+    B.CreateBr(Probe);
+
+    // An empty slot means the arguments aren't in the table
+    B.SetInsertPoint(Probe);
+    PHINode* Step = B.CreatePHI(I64, 2);
+    Step->addIncoming(B.getInt64(0), Entry);
+    Value* Slot = B.CreateAnd(B.CreateAdd(Home, Step), NumEntries - 1);
+    Value* Seq = AtomicLoad(SeqPtr(Slot), AtomicOrdering::Acquire);
+    B.CreateCondBr(B.CreateICmpEQ(Seq, B.getInt64(0)), Miss, Check);
+
+    B.SetInsertPoint(Check);
+    Value* Match = B.CreateICmpEQ(B.CreateAnd(Seq, 1), B.getInt64(0));
+    for (unsigned I = 0; I != Keys.size(); ++I)
+        Match = B.CreateAnd(Match, B.CreateICmpEQ(
+            AtomicLoad(ArgPtr(Slot, I), AtomicOrdering::Monotonic), Keys[I]));
+    Value* Cached = AtomicLoad(ResultPtr(Slot), AtomicOrdering::Monotonic);
+    B.CreateFence(AtomicOrdering::Acquire);
+    Match = B.CreateAnd(Match, B.CreateICmpEQ(Seq,
+        AtomicLoad(SeqPtr(Slot), AtomicOrdering::Monotonic)));
+    B.CreateCondBr(Match, Hit, Next);
+
+    B.SetInsertPoint(Hit);
+    B.CreateRet(B.CreateBitCast(Cached, B.getDoubleTy()));
+
+    B.SetInsertPoint(Next);
+    Value* NextStep = B.CreateAdd(Step, B.getInt64(1));
+    Step->addIncoming(NextStep, Next);
+    B.CreateCondBr(B.CreateICmpULT(NextStep, B.getInt64(MemoProbes)), Probe, Evict);
+
+    // Every slot probed is taken, so the result replaces the home slot's
+    B.SetInsertPoint(Evict);
+    Value* HomeSeq = AtomicLoad(SeqPtr(Home), AtomicOrdering::Monotonic);
+    B.CreateBr(Miss);
+
+    B.SetInsertPoint(Miss);
+    PHINode* Target = B.CreatePHI(I64, 2);
+    Target->addIncoming(Slot, Probe);
+    Target->addIncoming(Home, Evict);
+    PHINode* Expected = B.CreatePHI(I64, 2);
+    Expected->addIncoming(B.getInt64(0), Probe);
+    Expected->addIncoming(HomeSeq, Evict);
+    CallInst* Result = B.CreateCall(&F, Args);
+    B.CreateCondBr(B.CreateICmpEQ(B.CreateAnd(Expected, 1), B.getInt64(0)),
+        Claim, Done);
+
+    B.SetInsertPoint(Claim);
+    Value* Claimed = B.CreateExtractValue(B.CreateAtomicCmpXchg(SeqPtr(Target),
+        Expected, B.CreateAdd(Expected, B.getInt64(1)), MaybeAlign(8),
+        AtomicOrdering::Monotonic, AtomicOrdering::Monotonic), 1);
+    B.CreateCondBr(Claimed, Store, Done);
+
+    // The fence keeps readers from seeing the new data under the old Seq
+    B.SetInsertPoint(Store);
+    B.CreateFence(AtomicOrdering::Release);
+    for (unsigned I = 0; I != Keys.size(); ++I)
+        AtomicStore(Keys[I], ArgPtr(Target, I), AtomicOrdering::Monotonic);
+    AtomicStore(B.CreateBitCast(Result, I64), ResultPtr(Target),
+        AtomicOrdering::Monotonic);
+    AtomicStore(B.CreateAdd(Expected, B.getInt64(2)), SeqPtr(Target),
+        AtomicOrdering::Release);
+    B.CreateBr(Done);
+
+    B.SetInsertPoint(Done);
+    B.CreateRet(Result);
+    B.SetCurrentDebugLocation(DebugLoc());
+
+    verifyFunction(*Memo);
+    return Memo;
+}
+
+//===----------------------------------------------------------------------===//
+// Ahead-of-time compilation
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string> LinkerPath("linker",
+    cl::desc("C compiler driver used to link with -link"), cl::init("cc"));
+
+// Brings in -mcpu (including -mcpu=native), -mattr, -relocation-model, ...
+static codegen::RegisterCodeGenFlags CGF;
+
+static FunctionCallee getDPrintf() {
+    // int dprintf(int fd, const char *format, ...) - writes straight to a file
+    // descriptor, so the generated code needs no FILE* for stderr.
+    return S->TheModule->getOrInsertFunction("dprintf",
+        FunctionType::get(S->Builder->getInt32Ty(),
+            { S->Builder->getInt32Ty(), S->Builder->getInt8PtrTy() }, true));
+}
+
+// Give bodies to the runtime functions the script declared with extern, so a
+// linked executable does not need the JIT's versions of them.
+static void EmitRuntime() {
+    auto DefineRuntimeFn = [](StringRef Name, StringRef Format, bool AsChar) {
+        Function* F = S->TheModule->getFunction(Name);
+        if (!F || !F->isDeclaration() || F->arg_size() != 1)
+            return;
+        S->Builder->SetInsertPoint(BasicBlock::Create(*S->TheContext, "entry", F));
+        Value* Arg = F->getArg(0);
+        if (AsChar)
+            Arg = S->Builder->CreateFPToSI(Arg, S->Builder->getInt32Ty());
+        S->Builder->CreateCall(getDPrintf(),
+            { S->Builder->getInt32(2), S->Builder->CreateGlobalStringPtr(Format), Arg });
+        S->Builder->CreateRet(ConstantFP::get(*S->TheContext, APFloat(0.0)));
+    };
+
+    DefineRuntimeFn("putchard", "%c", true);
+    DefineRuntimeFn("printd", "%f\n", false);
+
+    // The output builtins write through stdio's stdout, which is buffered
+    // unless it is a terminal and flushed when main returns
+    IRBuilder<>& B = *S->Builder;
+    Type* Double = B.getDoubleTy();
+    Value* Zero = ConstantFP::get(Double, 0.0);
+    // writea calls writed, so it goes first
+    if (Function* F = S->TheModule->getFunction("kaleidoscope_writea")) {
+        auto* Entry = BasicBlock::Create(*S->TheContext, "entry", F);
+        auto* Loop = BasicBlock::Create(*S->TheContext, "loop", F);
+        auto* Done = BasicBlock::Create(*S->TheContext, "done", F);
+        B.SetInsertPoint(Entry);
+        B.CreateCondBr(B.CreateICmpEQ(F->getArg(1), B.getInt64(0)), Done, Loop);
+        B.SetInsertPoint(Loop);
+        PHINode* I = B.CreatePHI(B.getInt64Ty(), 2, "i");
+        I->addIncoming(B.getInt64(0), Entry);
+        B.CreateCall(getOutputFunction("writed"), { B.CreateLoad(Double,
+            B.CreateInBoundsGEP(Double, F->getArg(0), I)) });
+        Value* Next = B.CreateAdd(I, B.getInt64(1));
+        I->addIncoming(Next, Loop);
+        B.CreateCondBr(B.CreateICmpEQ(Next, F->getArg(1)), Done, Loop);
+        B.SetInsertPoint(Done);
+        B.CreateRet(Zero);
+    }
+    if (Function* F = S->TheModule->getFunction("kaleidoscope_writed")) {
+        B.SetInsertPoint(BasicBlock::Create(*S->TheContext, "entry", F));
+        FunctionCallee Printf = S->TheModule->getOrInsertFunction("printf",
+            FunctionType::get(B.getInt32Ty(), { B.getInt8PtrTy() }, true));
+        B.CreateCall(Printf, { B.CreateGlobalStringPtr("%.17g\n"), F->getArg(0) });
+        B.CreateRet(Zero);
+    }
+    if (Function* F = S->TheModule->getFunction("kaleidoscope_writeraw")) {
+        B.SetInsertPoint(BasicBlock::Create(*S->TheContext, "entry", F));
+        // glibc's FILE* stdout is a variable of that name; Darwin's isn't
+        Type* FilePtr = B.getInt8PtrTy();
+        bool Darwin = S->AOTTarget->getTargetTriple().isOSDarwin();
+        auto* Stdout = S->TheModule->getOrInsertGlobal(
+            Darwin ? "__stdoutp" : "stdout", FilePtr);
+        FunctionCallee Fwrite = S->TheModule->getOrInsertFunction("fwrite",
+            FunctionType::get(B.getInt64Ty(),
+                { FilePtr, B.getInt64Ty(), B.getInt64Ty(), FilePtr }, false));
+        B.CreateCall(Fwrite, { B.CreateBitCast(F->getArg(0), FilePtr),
+            B.getInt64(sizeof(double)), F->getArg(1), B.CreateLoad(FilePtr, Stdout) });
+        B.CreateRet(Zero);
+    }
+}
+
+// int main() { evaluate each top-level expression in order, printing the
+// result the same way the REPL does }
+static bool EmitMain() {
+    if (S->TheModule->getFunction("main")) {
+        LogError("'main' is reserved for the generated entry point");
+        return false;
+    }
+
+    Function* Main = Function::Create(
+        FunctionType::get(S->Builder->getInt32Ty(), false),
+        Function::ExternalLinkage, "main", S->TheModule.get());
+    S->Builder->SetInsertPoint(BasicBlock::Create(*S->TheContext, "entry", Main));
+
+    Value* Format = S->Builder->CreateGlobalStringPtr("Evaluated to %f\n");
+    for (Function* Expr : S->AOTExprs) {
+        Value* Result = S->Builder->CreateCall(Expr, {}, "result");
+        S->Builder->CreateCall(getDPrintf(), { S->Builder->getInt32(2), Format, Result });
+    }
+    S->Builder->CreateRet(S->Builder->getInt32(0));
+    return true;
+}
+
+static CodeGenOpt::Level getCodeGenOptLevel() {
+    switch (S->Opts.OptLevel) {
+    case 0: return CodeGenOpt::None;
+    case 1: return CodeGenOpt::Less;
+    case 3: return CodeGenOpt::Aggressive;
+    default: return CodeGenOpt::Default;
+    }
+}
+
+static std::unique_ptr<TargetMachine> CreateAOTTargetMachine() {
+    Triple TheTriple(sys::getDefaultTargetTriple());
+    std::string Error;
+    const Target* TheTarget = TargetRegistry::lookupTarget(TheTriple.str(), Error);
+    if (!TheTarget) {
+        fprintf(stderr, "Error: %s\n", Error.c_str());
+        return nullptr;
+    }
+
+    // Position independent by default so the object links into a PIE
+    const SessionOptions& Opts = S->Opts;
+    return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+        TheTriple.str(), Opts.TargetCPU, Opts.TargetFeatures, Opts.TargetOpts,
+        Opts.RelocModel ? *Opts.RelocModel : Reloc::PIC_, None,
+        getCodeGenOptLevel()));
+}
+
+static bool EmitObjectFile(StringRef Path) {
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+        return false;
+    }
+
+    legacy::PassManager PM;
+    if (S->AOTTarget->addPassesToEmitFile(PM, Out, nullptr, CGFT_ObjectFile)) {
+        LogError("target cannot emit object files");
+        return false;
+    }
+    PM.run(*S->TheModule);
+    Out.flush();
+    return !Out.has_error();
+}
+
+static bool LinkObjectFile(StringRef ObjPath, StringRef ExePath) {
+    auto Linker = sys::findProgramByName(S->Opts.LinkerPath);
+    if (!Linker) {
+        fprintf(stderr, "Error: cannot find linker '%s'\n",
+            S->Opts.LinkerPath.c_str());
+        return false;
+    }
+
+    StringRef Args[] = { *Linker, ObjPath, "-o", ExePath, "-lm" };
+    std::string ErrMsg;
+    if (sys::ExecuteAndWait(*Linker, Args, None, {}, 0, 0, &ErrMsg) != 0) {
+        fprintf(stderr, "Error: linking failed %s\n", ErrMsg.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Compile the whole input into one module and write it out, no JIT involved.
+static bool RunAOT(StringRef OutputFilename, bool LinkExecutable) {
+    S->AOTTarget = CreateAOTTargetMachine();
+    if (!S->AOTTarget)
+        return false;
+
+    // Same quiet, single-module flow as -batch, optimized as a whole at the end
+    S->Opts.Batch = true;
+    S->DeferOptimization = true;
+    InitializeModule();
+    getNextToken();
+    MainLoop();
+
+    if (LinkExecutable)
+        EmitRuntime();
+    if ((LinkExecutable || !S->AOTExprs.empty()) && !EmitMain())
+        return false;
+
+    if (verifyModule(*S->TheModule, &errs()))
+        return false;
+    OptimizeModule(*S->TheModule, S->AOTTarget.get());
+
+    if (!LinkExecutable)
+        return EmitObjectFile(OutputFilename);
+
+    std::string ObjPath = (OutputFilename + ".o").str();
+    bool Ok = EmitObjectFile(ObjPath) && LinkObjectFile(ObjPath, OutputFilename);
+    sys::fs::remove(ObjPath);
+    return Ok;
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+// Output of the write builtins. Each thread appends to a buffer of its own,
+// so map threads don't contend for stdout, and hands it over in one piece
+// when it fills up, between top-level items, at the end of each map task and
+// when the thread exits.
+namespace {
+    struct OutputBuffer {
+        std::string Data;
+
+        ~OutputBuffer() { flush(); }
+
+        void flush() {
+            if (Data.empty())
+                return;
+            fwrite(Data.data(), 1, Data.size(), stdout);
+            fflush(stdout);
+            Data.clear();
+        }
+    };
+}
+
+static const size_t OutputBufferSize = 1 << 16;
+static thread_local OutputBuffer Output;
+
+static void FlushOutput() {
+    Output.flush();
+}
+
+static void WriteOutput(const char* Bytes, size_t Size) {
+    if (Output.Data.size() + Size > OutputBufferSize)
+        Output.flush();
+    // Large blocks go straight out rather than through the buffer
+    if (Size >= OutputBufferSize) {
+        fwrite(Bytes, 1, Size, stdout);
+        fflush(stdout);
+        return;
+    }
+    Output.Data.append(Bytes, Size);
+}
+
+// 17 significant digits, so the text reads back as the same double
+static void WriteDouble(double X) {
+    char Text[32];
+    WriteOutput(Text, snprintf(Text, sizeof(Text), "%.17g\n", X));
+}
+
+/// kaleidoscope_writed - writed(x): write x and a newline to stdout.
+extern "C" DLLEXPORT double kaleidoscope_writed(double X) {
+    WriteDouble(X);
+    return 0;
+}
+
+/// kaleidoscope_writea - writea(a): write each double in a on a line of its
+/// own.
+extern "C" DLLEXPORT double kaleidoscope_writea(const double* Data, uint64_t Size) {
+    for (uint64_t I = 0; I != Size; ++I)
+        WriteDouble(Data[I]);
+    return 0;
+}
+
+/// kaleidoscope_writeraw - writeraw(a): write the doubles in a as raw bytes.
+extern "C" DLLEXPORT double kaleidoscope_writeraw(const double* Data, uint64_t Size) {
+    WriteOutput((const char*)Data, Size * sizeof(double));
+    return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Session API
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool> LazyMode("lazy",
+    cl::desc("Compile each function on its first call instead of when defined"));
+
+static cl::opt<unsigned> CompileThreads("compile-threads",
+    cl::desc("Optimize and compile definitions on N background threads while "
+             "parsing continues (0 = compile on the main thread)"),
+    cl::init(0));
+
+static cl::opt<std::string> ObjectCacheDir("object-cache-dir",
+    cl::desc("Keep compiled objects in this directory and reuse them on later runs"),
+    cl::value_desc("directory"));
+
+static cl::list<JITListenerKind> JITListeners("jit-listener", cl::CommaSeparated,
+    cl::desc("Tell profilers and debuggers about JIT'd code (add -g for line "
+             "tables):"),
+    cl::values(
+        clEnumValN(JL_PerfMap, "perf-map", "Function symbols in /tmp/perf-<pid>.map"),
+        clEnumValN(JL_JITDump, "jitdump", "Code and line tables in a jitdump file "
+                                          "for perf inject --jit"),
+        clEnumValN(JL_GDB, "gdb", "Objects registered through GDB's JIT interface")));
+
+// The process-wide listener for Kind
+static Expected<JITEventListener*> GetJITListener(JITListenerKind Kind) {
+    switch (Kind) {
+    case JL_PerfMap: {
+        auto L = PerfMapListener::get();
+        if (!L)
+            return L.takeError();
+        return &*L;
+    }
+    case JL_JITDump:
+        if (auto* L = JITEventListener::createPerfJITEventListener())
+            return L;
+        return make_error<StringError>("LLVM was built without jitdump support",
+            inconvertibleErrorCode());
+    case JL_GDB:
+        return JITEventListener::createGDBRegistrationListener();
+    }
+    llvm_unreachable("Unknown JIT listener");
+}
+
+// Register the host target with LLVM, once per process
+static void InitializeHostTarget() {
+    static bool Initialized = [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+        return true;
+    }();
+    (void)Initialized;
+}
+
+SessionOptions SessionOptions::fromCommandLine() {
+    SessionOptions Opts;
+    Opts.Batch = BatchMode;
+    Opts.BatchChunkSize = ::BatchChunkSize;
+    Opts.OptLevel = ::OptLevel;
+    Opts.FastMath = ::FastMath;
+    Opts.DebugInfo = ::DebugInfo;
+    Opts.Lazy = LazyMode;
+    Opts.HotSwap = ::HotSwap;
+    Opts.TierThreshold = ::TierThreshold;
+    Opts.ExprCacheSize = ::ExprCacheSize;
+    Opts.MemoSize = ::MemoSize;
+    Opts.MapThreads = ::MapThreads;
+    Opts.ExprThreads = ::ExprThreads;
+    Opts.CompileThreads = ::CompileThreads;
+    Opts.PGOThreshold = ::PGOThreshold;
+    Opts.InlineImportLimit = ::InlineImportLimit;
+    Opts.ObjectCacheDir = ::ObjectCacheDir;
+    Opts.JITListeners.assign(::JITListeners.begin(), ::JITListeners.end());
+    Opts.LinkerPath = ::LinkerPath;
+    // LLVM's own -mcpu, -mattr, -relocation-model, ... for compileToFile()
+    Triple TheTriple(sys::getDefaultTargetTriple());
+    Opts.TargetCPU = codegen::getCPUStr();
+    Opts.TargetFeatures = codegen::getFeaturesStr();
+    Opts.TargetOpts = codegen::InitTargetOptionsFromCodeGenFlags(TheTriple);
+    Opts.RelocModel = codegen::getExplicitRelocModel();
+    Opts.PrintStats = PhaseStats;
+    Opts.StatsJSON = PhaseStatsJSON;
+
+    if (TimePassesIsEnabled) {
+        // Neither the new PM's pass timers nor the legacy codegen timers are
+        // thread-safe.
+        if (Opts.CompileThreads > 0) {
+            fprintf(stderr, "warning: -time-passes ignores -compile-threads\n");
+            Opts.CompileThreads = 0;
+        }
+        if (Opts.PGOThreshold > 0) {
+            fprintf(stderr, "warning: -time-passes ignores -pgo-threshold\n");
+            Opts.PGOThreshold = 0;
+        }
+        Opts.TimePasses = true;
+    }
+
+    // An inlined copy would keep running the old body after a redefinition
+    if (Opts.HotSwap) {
+        Opts.InlineImportLimit = 0;
+        Opts.InlineIntoTierUps = false;
+    }
+    return Opts;
+}
+
+Session::Session(SessionOptions Opts) : Opts(std::move(Opts)) {
+    Src.TrackLines = this->Opts.DebugInfo;
+    if (this->Opts.PrintStats || !this->Opts.StatsJSON.empty())
+        Stats = std::make_unique<SessionStats>();
+    if (this->Opts.TimePasses)
+        PassTimer = std::make_unique<TimePassesHandler>(true);
+}
+
+Session::~Session() = default;
+
+Expected<std::unique_ptr<Session>> Session::Create(SessionOptions Opts) {
+    auto Sess = std::make_unique<Session>(std::move(Opts));
+    if (auto Err = Sess->initializeJIT())
+        return Err;
+    return Sess;
+}
+
+Error Session::initializeJIT() {
+    SessionScope Scope(*this);
+    InitializeHostTarget();
+    auto JIT = KaleidoscopeJIT::Create(Opts.Lazy, Opts.CompileThreads);
+    if (!JIT)
+        return JIT.takeError();
+    TheJIT = std::move(*JIT);
+    for (JITListenerKind Kind : Opts.JITListeners) {
+        auto L = GetJITListener(Kind);
+        if (!L)
+            return L.takeError();
+        TheJIT->registerJITEventListener(**L);
+        // A perf map can't retire the entries of freed code, such as one-shot
+        // top-level expressions, so their addresses must not be reused
+        if (Kind == JL_PerfMap)
+            TheJIT->reserveFreedCode();
+    }
+    if (Opts.HotSwap || Opts.PGOThreshold)
+        TheJIT->enableHotSwap();
+    if (Opts.PGOThreshold) {
+        TierUpThread = std::make_unique<ThreadPool>(hardware_concurrency(1));
+        // What InstrumentForProfile's callbacks reach
+        if (auto Err = TheJIT->defineAbsolute("__pgo.session", this))
+            return Err;
+        if (auto Err = TheJIT->defineAbsolute("__pgo.request_tier_up",
+                reinterpret_cast<const void*>(&RequestTierUp)))
+            return Err;
+    }
+    if (Opts.MapThreads != 1)
+        MapThreadPool = std::make_unique<ThreadPool>(hardware_concurrency(Opts.MapThreads));
+    if (Opts.Batch && Opts.ExprThreads != 1)
+        ExprThreadPool = std::make_unique<ThreadPool>(hardware_concurrency(Opts.ExprThreads));
+    if (!Opts.ObjectCacheDir.empty()) {
+        auto Cache = DiskObjectCache::Create(Opts.ObjectCacheDir,
+            "newpm-O" + std::to_string(Opts.OptLevel));
+        if (!Cache)
+            return Cache.takeError();
+        TheJIT->setObjectCache(std::move(*Cache));
+    }
+
+    // Batches are optimized as a whole when compiled so the module passes see
+    // all their definitions. Lazy and threaded compiles optimize off the REPL
+    // path, cache keys are computed from unoptimized IR, with tiering most
+    // definitions may never be compiled at all, and profiled definitions must
+    // be instrumented before they are optimized.
+    DeferOptimization = Opts.Batch || Opts.Lazy || Opts.CompileThreads > 0 ||
+        !Opts.ObjectCacheDir.empty() || Opts.TierThreshold > 0 || Opts.PGOThreshold > 0;
+    if (DeferOptimization) {
+        // Runs on whichever thread compiles the module
+        TheJIT->setOptimizer([this](Module& M, TargetMachine* TM) {
+            SessionScope Scope(*this);
+            OptimizeModule(M, TM);
+        });
+    }
+    else {
+        auto TM = TheJIT->createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+        TheTargetMachine = std::move(*TM);
+    }
+
+    InitializeModule();
+    return Error::success();
+}
+
+void Session::run() {
+    SessionScope Scope(*this);
+    if (!Opts.Batch)
+        fprintf(stderr, "ready> ");
+    getNextToken();
+    MainLoop();
+    FoldLexTotals();
+
+    // Recompiles still in flight refer to TheJIT
+    if (TierUpThread)
+        TierUpThread->wait();
+    // Definitions handed to compile threads that nothing has called yet
+    TheJIT->wait();
+}
+
+bool Session::compileToFile(StringRef Path, bool Link) {
+    SessionScope Scope(*this);
+    InitializeHostTarget();
+    return RunAOT(Path, Link);
+}
+
+uint64_t Session::lexOnly() {
+    SessionScope Scope(*this);
+    uint64_t NumTokens = 0;
+    while (gettok() != tok_eof)
+        ++NumTokens;
+    return NumTokens;
+}
+
+bool Session::compile(StringRef Source) {
+    SessionScope Scope(*this);
+    unsigned Errors = NumErrors;
+    Src.openBuffer(Source);
+    getNextToken();
+    MainLoop();
+    FoldLexTotals();
+    return NumErrors == Errors;
+}
+
+Expected<JITEvaluatedSymbol> Session::lookup(StringRef Name) {
+    SessionScope Scope(*this);
+    return TheJIT->lookup(Name);
+}
+
+Expected<double> Session::call(StringRef Name, ArrayRef<double> Args) {
+    SessionScope Scope(*this);
+    auto PI = FunctionProtos.find(Interner.intern(Name));
+    if (PI == FunctionProtos.end() || !PI->second->isScalar() ||
+        PI->second->getArgs().size() != Args.size() || Args.size() > MaxNativeArgs)
+        return make_error<StringError>("no function " + Name + " of " +
+            Twine(Args.size()) + " doubles", inconvertibleErrorCode());
+
+    auto Sym = TheJIT->lookup(Name);
+    if (!Sym)
+        return Sym.takeError();
+    PhaseTimer Timer(PH_Execute, /*ForCurrentItem=*/false);
+    double Result = CallNative((void*)(intptr_t)Sym->getAddress(), Args.size(), Args.data());
+    FlushOutput();
+    return Result;
+}
+
+bool Session::evaluateBatch(StringRef Name, ArrayRef<const double*> Columns,
+    double* Out, size_t Rows) {
+    SessionScope Scope(*this);
+    bool Ok = EvaluateBatch(Interner.intern(Name), Columns, Out, Rows);
+    FlushOutput();
+    return Ok;
+}
+
+Error Session::bindArray(StringRef Name, double* Data, size_t Size) {
+    SessionScope Scope(*this);
+    if (Name.empty() || !CharClass.is(Name[0], CC_IdentStart) ||
+        !all_of(Name, [](char C) { return CharClass.is(C, CC_IdentBody); }))
+        return make_error<StringError>("'" + Name + "' is not a valid array name",
+            inconvertibleErrorCode());
+    // Entries of a StringMap stay put, so the JIT can point code at the view
+    auto Inserted = HostArrays.try_emplace(Name, ArrayView{ Data, Size });
+    if (!Inserted.second) {
+        Inserted.first->second = { Data, Size };
+        return Error::success();
+    }
+    return TheJIT->defineAbsolute(("__array." + Name).str(), &Inserted.first->second);
+}
+
+static void PrintPhaseStats() {
+    SessionStats& Stats = *S->Stats;
+    uint64_t Total = 0;
+    for (auto& T : Stats.Totals)
+        Total += T.Nanos;
+
+    fprintf(stderr, "===-------------------------------------------------------===\n");
+    fprintf(stderr, "                     Kaleidoscope phases\n");
+    fprintf(stderr, "===-------------------------------------------------------===\n");
+    fprintf(stderr, "  %-10s %12s %12s %7s %12s\n", "Phase", "Count", "Total (ms)",
+        "%", "Max (us)");
+    for (int P = 0; P < NumPhases; ++P) {
+        auto& T = Stats.Totals[P];
+        fprintf(stderr, "  %-10s %12llu %12.3f %6.1f%% %12.1f\n", PhaseNames[P],
+            (unsigned long long)T.Count.load(), T.Nanos / 1e6,
+            Total ? 100.0 * T.Nanos / Total : 0.0, T.MaxNanos / 1e3);
+    }
+    fprintf(stderr, "  %-10s %12s %12.3f\n", "Total", "", Total / 1e6);
+    fprintf(stderr, "\n  Items: %u definitions, %u externs, %u expressions\n",
+        Stats.ItemCounts[0], Stats.ItemCounts[1], Stats.ItemCounts[2]);
+    fprintf(stderr, "  Peak RSS: %.1f MB\n", GetPeakRSSBytes() / (1024.0 * 1024.0));
+    if (S->TheJIT)
+        fprintf(stderr, "  JIT code: %llu bytes, data: %llu bytes\n",
+            (unsigned long long)S->TheJIT->getCodeBytes(),
+            (unsigned long long)S->TheJIT->getDataBytes());
+    if (S->ExprCacheHits || S->ExprCacheMisses)
+        fprintf(stderr, "  Expression cache: %u hits, %u misses\n",
+            S->ExprCacheHits, S->ExprCacheMisses);
+    if (S->NumTierUps)
+        fprintf(stderr, "  Profile-guided recompiles: %u\n", S->NumTierUps);
+}
+
+static void WritePhaseStatsJSON() {
+    SessionStats& Stats = *S->Stats;
+    std::error_code EC;
+    raw_fd_ostream OS(S->Opts.StatsJSON, EC);
+    if (EC) {
+        errs() << "Could not open " << S->Opts.StatsJSON << ": " << EC.message() << "\n";
+        return;
+    }
+
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attributeObject("phases", [&] {
+            for (int P = 0; P < NumPhases; ++P) {
+                auto& T = Stats.Totals[P];
+                J.attributeObject(PhaseNames[P], [&] {
+                    J.attribute("count", (int64_t)T.Count.load());
+                    J.attribute("total_ns", (int64_t)T.Nanos.load());
+                    J.attribute("max_ns", (int64_t)T.MaxNanos.load());
+                });
+            }
+        });
+        J.attributeObject("items", [&] {
+            J.attribute("definitions", Stats.ItemCounts[0]);
+            J.attribute("externs", Stats.ItemCounts[1]);
+            J.attribute("expressions", Stats.ItemCounts[2]);
+        });
+        J.attribute("peak_rss_bytes", (int64_t)GetPeakRSSBytes());
+        if (S->TheJIT) {
+            J.attribute("jit_code_bytes", (int64_t)S->TheJIT->getCodeBytes());
+            J.attribute("jit_data_bytes", (int64_t)S->TheJIT->getDataBytes());
+        }
+        J.attribute("expr_cache_hits", S->ExprCacheHits);
+        J.attribute("expr_cache_misses", S->ExprCacheMisses);
+        J.attribute("pgo_recompiles", S->NumTierUps);
+        J.attributeArray("per_item", [&] {
+            for (auto& Item : Stats.ItemLog)
+                J.object([&] {
+                    J.attribute("kind", Item.Kind == 'd' ? "def" :
+                        Item.Kind == 'e' ? "extern" : "expr");
+                    if (!Item.Name.empty())
+                        J.attribute("name", Item.Name);
+                    for (int P = 0; P < NumPhases; ++P)
+                        if (Item.Nanos[P])
+                            J.attribute(std::string(PhaseNames[P]) + "_ns",
+                                (int64_t)Item.Nanos[P]);
+                });
+        });
+    });
+    OS << "\n";
+}
+
+static void ReportPhaseStats() {
+    if (!S->Stats)
+        return;
+    FoldLexTotals();
+    if (S->Opts.PrintStats)
+        PrintPhaseStats();
+    if (!S->Opts.StatsJSON.empty())
+        WritePhaseStatsJSON();
+}
+
+void Session::reportStats() {
+    SessionScope Scope(*this);
+    ReportPhaseStats();
+    ReportPassTimings();
+}
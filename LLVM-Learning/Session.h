@@ -0,0 +1,444 @@
+//===- Session.h - An embeddable Kaleidoscope compiler ---------*- C++ -*-===//
+//
+// A Session is one Kaleidoscope compiler with its own JIT. Host programs
+// create one per use with Session::Create(), compile() source into it, bind
+// host memory to it as arrays and call the functions it defines. The
+// kaleidoscope driver in main.cpp is a Session fed from a file or stdin.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SESSION_H
+#define KALEIDOSCOPE_SESSION_H
+
+#include "KaleidoscopeJIT.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// SourceReader - Owns the bytes the lexer scans. Files are memory-mapped in
+/// one go, stdin is pulled in large blocks. The window [Cur, End) always stops
+/// on a line boundary, so a token never straddles a refill and can be handed
+/// out as a StringRef into the buffer.
+class SourceReader {
+    std::unique_ptr<llvm::MemoryBuffer> File;
+    std::vector<char> Block; // Staging area when streaming from stdin
+    size_t BlockLen = 0;     // Bytes of Block holding data
+    bool Streaming = false;
+    bool AtEOF = false;
+public:
+    const char* Cur = nullptr;
+    const char* End = nullptr;
+    uint64_t BytesRead = 0;
+    std::string Name = "<input>";
+
+    // Lines are only counted when asked for (-g). Line is the line LinePos is
+    // on; newlines are counted up to a position when its line is asked for.
+    bool TrackLines = false;
+    unsigned Line = 1;
+    const char* LinePos = nullptr;
+
+    // Line of the character before P, which must not be behind the position
+    // of an earlier call
+    unsigned lineAt(const char* P) {
+        Line += std::count(LinePos, P, '\n');
+        LinePos = P;
+        return Line;
+    }
+
+    // Scan Text in place; it must stay alive until it has been read.
+    void openBuffer(llvm::StringRef Text) {
+        File.reset();
+        Streaming = false;
+        AtEOF = true;
+        Cur = Text.begin();
+        End = Text.end();
+        BytesRead += Text.size();
+        Line = 1;
+        LinePos = Cur;
+    }
+
+    // Path "-" selects stdin.
+    bool open(llvm::StringRef Path) {
+        Name = Path == "-" ? "<stdin>" : Path.str();
+        Line = 1;
+        if (Path == "-") {
+            Streaming = true;
+            Block.resize(1 << 16);
+            return true;
+        }
+
+        auto FileOrErr = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+            /*RequiresNullTerminator=*/false);
+        if (!FileOrErr) {
+            fprintf(stderr, "Error: cannot open '%s': %s\n", Path.str().c_str(),
+                FileOrErr.getError().message().c_str());
+            return false;
+        }
+        File = std::move(*FileOrErr);
+        Cur = File->getBufferStart();
+        End = File->getBufferEnd();
+        LinePos = Cur;
+        BytesRead = File->getBufferSize();
+        AtEOF = true;
+        return true;
+    }
+
+    // Called once the lexer has consumed the whole window. Returns false at EOF.
+    bool refill() {
+        if (!Streaming)
+            return false;
+        if (TrackLines)
+            lineAt(End);
+
+        // Carry the partial line left behind the last window to the front.
+        size_t Tail = End ? Block.data() + BlockLen - End : 0;
+        if (Tail)
+            memmove(Block.data(), End, Tail);
+        BlockLen = Tail;
+
+        // Read until there is at least one complete line (one read() per line
+        // on a terminal, so the REPL stays interactive).
+        while (!AtEOF && !memchr(Block.data(), '\n', BlockLen)) {
+            if (BlockLen == Block.size())
+                Block.resize(Block.size() * 2);
+            auto N = llvm::sys::fs::readNativeFile(llvm::sys::fs::getStdinHandle(),
+                llvm::makeMutableArrayRef(Block.data() + BlockLen, Block.size() - BlockLen));
+            if (!N) {
+                llvm::consumeError(N.takeError());
+                AtEOF = true;
+            }
+            else if (*N == 0) {
+                AtEOF = true;
+            }
+            BlockLen += N ? *N : 0;
+            BytesRead += N ? *N : 0;
+        }
+
+        size_t Lim = BlockLen;
+        if (!AtEOF)
+            while (Block[Lim - 1] != '\n')
+                --Lim;
+        Cur = Block.data();
+        End = Block.data() + Lim;
+        LinePos = Cur;
+        return Cur != End;
+    }
+};
+
+// Identifiers are interned once and passed around as small integer IDs
+using SymbolID = unsigned;
+
+/// StringInterner - Maps every identifier to a SymbolID so that symbol tables
+/// hash and compare integers instead of strings. Interned names are owned by
+/// the interner, which lives as long as its session.
+class StringInterner {
+    llvm::StringMap<SymbolID> IDs;
+    std::vector<llvm::StringRef> Names;
+public:
+    SymbolID intern(llvm::StringRef Str) {
+        auto Result = IDs.try_emplace(Str, (SymbolID)Names.size());
+        if (Result.second)
+            Names.push_back(Result.first->getKey());
+        return Result.first->second;
+    }
+
+    llvm::StringRef getName(SymbolID ID) const { return Names[ID]; }
+};
+
+// Defined in Session.cpp
+class ExprAST;
+class PrototypeAST;
+struct TieredFunction;
+struct CachedExpr;
+struct TieredExpr;
+struct ProfiledFunction;
+struct TierUp;
+struct BatchKernel;
+struct PendingExpr;
+struct MemoTable;
+struct SessionStats;
+
+// What an array value holds: the address of its first double and how many
+// there are. A host array is bound by name to one of these, which code reads
+// each time it runs, so the host can rebind it without a recompile.
+struct ArrayView {
+    double* Data;
+    uint64_t Size;
+};
+
+// JIT event listeners a session can register
+enum JITListenerKind { JL_PerfMap, JL_JITDump, JL_GDB };
+
+/// SessionOptions - The settings a session is created with. The compiler reads
+/// nothing else, so each session can be set up differently, and a host that
+/// never parses a command line sets them here.
+struct SessionOptions {
+    // No prompts or IR echo, and definitions are packed into shared modules,
+    // BatchChunkSize definitions at most (0 = no limit)
+    bool Batch = false;
+    unsigned BatchChunkSize = 0;
+    // Optimization level, 0 to 3
+    unsigned OptLevel = 2;
+    // Let the optimizer reassociate floating-point math, contract multiply-adds
+    // and assume there are no NaNs or infinities
+    bool FastMath = false;
+    // Emit line tables mapping generated code back to the source
+    bool DebugInfo = false;
+    // Compile each function on its first call instead of when defined
+    bool Lazy = false;
+    // Call functions through stubs so a def can be redefined
+    bool HotSwap = false;
+    // Runs after which top-level expressions and functions are JIT'd instead
+    // of interpreted (0 = always JIT)
+    unsigned TierThreshold = 0;
+    // JIT'd top-level expressions kept for reuse (0 = discard after running)
+    unsigned ExprCacheSize = 64;
+    // Memo table entries of each pure function (0 = don't memoize)
+    unsigned MemoSize = 4096;
+    // Threads for batch evaluation and, with Batch, for independent top-level
+    // expressions (0 = one per core)
+    unsigned MapThreads = 1;
+    unsigned ExprThreads = 1;
+    // Threads optimizing and compiling definitions in the background (0 = on
+    // the session's thread)
+    unsigned CompileThreads = 0;
+    // Count at which a profiled function is recompiled with its profile (0 =
+    // no profiling)
+    unsigned PGOThreshold = 0;
+    // Size limit of the definitions copied into later modules for inlining
+    // (0 = off), and whether profile-guided recompiles inline their callees
+    unsigned InlineImportLimit = 100;
+    bool InlineIntoTierUps = true;
+    // Directory of compiled objects reused across runs (empty = none), and the
+    // JIT event listeners to register
+    std::string ObjectCacheDir;
+    std::vector<JITListenerKind> JITListeners;
+    // Target of compileToFile(), and the C compiler driver it links with.
+    // Without a relocation model the code is position independent.
+    std::string TargetCPU;
+    std::string TargetFeatures;
+    llvm::TargetOptions TargetOpts;
+    llvm::Optional<llvm::Reloc::Model> RelocModel;
+    std::string LinkerPath = "cc";
+    // Time each IR pass, for reportStats()
+    bool TimePasses = false;
+    // Print phase statistics when reported, and the file to write them to as
+    // JSON, with a record per top-level item
+    bool PrintStats = false;
+    std::string StatsJSON;
+
+    /// The settings the command-line options ask for.
+    static SessionOptions fromCommandLine();
+};
+
+/// Session - One compiler and JIT: lexer and parser state, the module being
+/// built, the JIT, and everything keyed on the session's definitions. Sessions
+/// share nothing but read-only tables and the JIT event listeners, so any
+/// number of them can run at once on different threads. A session must be
+/// used by one thread at a time; the compiler reaches the one in use through
+/// S, which the entry points below set with a SessionScope.
+class Session {
+public:
+    SessionOptions Opts;
+
+    // Lexer. IdentifierStr points into the source buffer and is only valid
+    // until the next call to gettok().
+    SourceReader Src;
+    llvm::StringRef IdentifierStr;
+    double NumVal = 0;
+
+    // Parser
+    int CurTok = 0;
+    StringInterner Interner;
+    // Expression nodes for the top-level item being parsed are bump-allocated
+    // here and released all at once when the item has been handled. Node
+    // destructors never run, so nodes must not own heap memory.
+    llvm::BumpPtrAllocator ASTArena;
+    // Source line of each expression node, with -g. Cleared before each
+    // top-level item, since the arena hands out the same addresses again.
+    llvm::DenseMap<const ExprAST*, unsigned> ExprLines;
+    unsigned NumErrors = 0;
+
+    // Code generation
+    std::unique_ptr<llvm::LLVMContext> TheContext;
+    std::unique_ptr<llvm::Module> TheModule;
+    std::unique_ptr<llvm::IRBuilder<>> Builder;
+    // With -g: the module's debug info builder and source file, and the
+    // function being generated. Each subprogram is finalized when its function
+    // is done, so the builder holds nothing of a module that has gone to the
+    // JIT.
+    std::unique_ptr<llvm::DIBuilder> DBuilder;
+    llvm::DIFile* DebugFile = nullptr;
+    llvm::DISubprogram* CurSubprogram = nullptr;
+    // Stack slot of each variable in scope. mem2reg turns them into SSA values.
+    llvm::DenseMap<SymbolID, llvm::AllocaInst*> NamedValues;
+    // Arrays the host has bound by name, and the view of each one that the
+    // function being generated has loaded in its entry block
+    llvm::StringMap<ArrayView> HostArrays;
+    llvm::DenseMap<SymbolID, llvm::Value*> HostArrayViews;
+    // The function being generated: its parameters' slots, and the block after
+    // their initialization that self-recursive tail calls branch back to.
+    llvm::SmallVector<llvm::AllocaInst*, 8> ParamAllocas;
+    llvm::BasicBlock* TailCallHeader = nullptr;
+    // Set when modules are optimized as a whole later on - by the JIT as it
+    // compiles them, or before the object file is written with -o - rather
+    // than right after each top-level item is codegen'd.
+    bool DeferOptimization = false;
+    llvm::DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
+    // Bumped each time a function gets a body, so caches keyed on a function
+    // can tell one definition from the next.
+    llvm::DenseMap<SymbolID, unsigned> FunctionVersions;
+
+    // Interpreter. Frames address the operand stack by index, since a callee
+    // may grow it.
+    llvm::DenseMap<SymbolID, std::unique_ptr<TieredFunction>> TieredFunctions;
+    std::vector<double> InterpStack;
+
+    // Profile-guided tier-up. Profiles outlive the JIT, whose code holds the
+    // addresses of their counters. ProfiledByName maps each profiled function
+    // to its current version and is written on the session's thread.
+    std::vector<std::unique_ptr<ProfiledFunction>> ProfiledFunctions;
+    llvm::StringMap<ProfiledFunction*> ProfiledByName;
+    std::mutex ProfileMutex;
+    unsigned NumTierUps = 0;
+
+    // Driver
+    // Definitions codegen'd into TheModule but not yet handed to the JIT
+    unsigned PendingDefs = 0;
+    // Set in ahead-of-time mode (-o), where everything goes into one module
+    // that is written out as an object file instead of being JIT'd, along with
+    // the top-level expressions compiled so far, in source order.
+    std::unique_ptr<llvm::TargetMachine> AOTTarget;
+    std::vector<llvm::Function*> AOTExprs;
+    // TargetMachine for optimizing on the session's thread; the JIT hands its
+    // compile threads their own.
+    std::unique_ptr<llvm::TargetMachine> TheTargetMachine;
+    // Bitcode for small optimized definitions, each alone in a module with
+    // declarations of its callees, keyed by function name. Written by
+    // whichever thread optimizes the definition.
+    llvm::StringMap<llvm::SmallVector<char, 0>> InlineCandidates;
+    std::mutex InlineCandidatesMutex;
+    // Run counts of the top-level expressions seen with TierThreshold, most
+    // recently run first, indexed by their bytecode. An expression that
+    // reaches TierThreshold runs is compiled like any other from then on.
+    std::list<TieredExpr> TieredExprLRU;
+    llvm::StringMap<std::list<TieredExpr>::iterator> TieredExprIndex;
+    unsigned NumCachedExprs = 0;
+    // The functions each definition calls directly and the effects of its
+    // body alone, and the effects a call to a function may have (EffectBits),
+    // worked out from them on demand and forgotten whenever a definition or
+    // extern comes in.
+    llvm::DenseMap<SymbolID, llvm::SmallVector<SymbolID, 4>> FunctionCallees;
+    llvm::DenseMap<SymbolID, unsigned> FunctionEffects;
+    llvm::DenseMap<SymbolID, unsigned> CalleeEffects;
+
+    // Phase statistics, kept when they are printed or written out, and the
+    // pass timings with TimePasses. Compile threads write to them, so they
+    // outlive the JIT.
+    std::unique_ptr<SessionStats> Stats;
+    std::unique_ptr<llvm::TimePassesHandler> PassTimer;
+
+    // Null in ahead-of-time mode. The members after it hold on to its code or
+    // threads that use it, so they go first.
+    std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+
+    // Expression cache, most recently used first
+    std::list<CachedExpr> ExprCacheLRU;
+    llvm::StringMap<std::list<CachedExpr>::iterator> ExprCacheIndex;
+    unsigned ExprCacheHits = 0, ExprCacheMisses = 0;
+
+    // Profile-guided recompiles waiting to be swapped in, and the thread
+    // producing them
+    std::vector<TierUp> ReadyTierUps;
+    std::unique_ptr<llvm::ThreadPool> TierUpThread;
+
+    // Batch kernels compiled so far, keyed by the function they apply
+    llvm::DenseMap<SymbolID, BatchKernel> BatchKernels;
+    std::unique_ptr<llvm::ThreadPool> MapThreadPool;
+
+    // Independent top-level expressions held back to run together, in source
+    // order, the index of each one compiled for the run by its ExprKey, and
+    // the threads that run them
+    std::vector<PendingExpr> ExprRun;
+    llvm::StringMap<size_t> ExprRunIndex;
+    std::unique_ptr<llvm::ThreadPool> ExprThreadPool;
+
+    // Memo table of each pure function, cleared whenever a function is
+    // redefined
+    llvm::DenseMap<SymbolID, MemoTable> MemoTables;
+
+    /// Create a session with a JIT.
+    static llvm::Expected<std::unique_ptr<Session>>
+    Create(SessionOptions Opts = SessionOptions::fromCommandLine());
+
+    /// A session without a JIT. initializeJIT() adds one; compileToFile() uses
+    /// it as is.
+    explicit Session(SessionOptions Opts);
+    ~Session();
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    llvm::Error initializeJIT();
+
+    /// Compile and run Source as if it had been typed at the prompt, printing
+    /// the same output. Returns false if any of it was rejected.
+    bool compile(llvm::StringRef Source);
+
+    /// Compile and run the rest of the input opened in Src, prompting for each
+    /// top-level item unless Opts.Batch is set. Returns once background
+    /// recompiles have finished.
+    void run();
+
+    /// Compile the rest of the input opened in Src into one module, with no
+    /// JIT involved, and write it to Path as an object file, or with Link as an
+    /// executable including the putchard/printd runtime. Returns false if that
+    /// failed; the reason has been printed.
+    bool compileToFile(llvm::StringRef Path, bool Link);
+
+    /// Lex the rest of the input opened in Src without parsing it, returning
+    /// the number of tokens.
+    uint64_t lexOnly();
+
+    /// Address of a function defined by compile(), compiling it if needed.
+    llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef Name);
+
+    /// Call a function of up to MaxNativeArgs doubles that returns a double.
+    llvm::Expected<double> call(llvm::StringRef Name, llvm::ArrayRef<double> Args);
+
+    /// Apply a function to columns of arguments; see EvaluateBatch().
+    bool evaluateBatch(llvm::StringRef Name, llvm::ArrayRef<const double*> Columns,
+        double* Out, size_t Rows);
+
+    /// Let code refer to the Size doubles at Data as the array Name, until it
+    /// is bound again. The memory is not copied and stays the caller's; it
+    /// must outlive any call that uses it.
+    llvm::Error bindArray(llvm::StringRef Name, double* Data, size_t Size);
+
+    /// Print, or write to Opts.StatsJSON, the phase statistics and pass timings
+    /// the session was created to keep.
+    void reportStats();
+};
+
+#endif // KALEIDOSCOPE_SESSION_H
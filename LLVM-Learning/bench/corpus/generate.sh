@@ -0,0 +1,52 @@
+#!/bin/sh
+# Writes the generated part of the benchmark corpus into a directory. The
+# output depends only on the arguments, so runs on different commits see the
+# same programs.
+#
+#   deep_tree.ks    definitions whose bodies are large, deeply nested
+#                   expression trees
+#   many_defs.ks    thousands of small definitions, each calling the previous
+#                   one, and a single expression that reaches all of them
+#   expr_stream.ks  a few definitions followed by a long stream of top-level
+#                   expressions
+#
+# Usage: bench/corpus/generate.sh <output dir> [scale]
+
+OUT=${1:?usage: generate.sh <output dir> [scale]}
+SCALE=${2:-1}
+mkdir -p "$OUT"
+
+awk -v n=$((32 * SCALE)) '
+function tree(depth, i) {
+    if (depth == 0)
+        return sprintf("(x * %d.5 - y)", i % 17)
+    return "(" tree(depth - 1, 2 * i) (depth % 3 == 0 ? " * " : depth % 3 == 1 ? " + " : " - ") tree(depth - 1, 2 * i + 1) ")"
+}
+function nest(depth,    s, i) {
+    s = "x"
+    for (i = 0; i < depth; i++)
+        s = "(" s " * 0.999 + " i ".5)"
+    return s
+}
+BEGIN {
+    for (i = 0; i < n; i++)
+        printf "def tree%d(x y) %s;\n", i, tree(10, i)
+    for (i = 0; i < n; i++)
+        printf "def nest%d(x) %s;\n", i, nest(200 + i)
+    for (i = 0; i < n; i++)
+        printf "tree%d(%d.25, 0.5) + nest%d(%d);\n", i, i, i, i
+}' > "$OUT/deep_tree.ks"
+
+awk -v n=$((2000 * SCALE)) 'BEGIN {
+    print "def d0(x) x;"
+    for (i = 1; i < n; i++)
+        printf "def d%d(x) d%d(x) * 0.5 + %d;\n", i, i - 1, i % 100
+    printf "d%d(1);\n", n - 1
+}' > "$OUT/many_defs.ks"
+
+awk -v n=$((1000 * SCALE)) 'BEGIN {
+    print "def poly(x) ((0.5 * x + 1.5) * x - 2.25) * x + 0.125;"
+    print "def blend(a b t) a * (1 - t) + b * t;"
+    for (i = 0; i < n; i++)
+        printf "blend(poly(%d), poly(%d.5), 0.%d) + %d;\n", i, i, i % 10, i
+}' > "$OUT/expr_stream.ks"
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Parser and codegen scaling on very large and deeply nested expressions.
+#
+# Generates top-level expressions of N/100, N/10 and N terms in three shapes: a
+# flat chain of operators, and parentheses nested N deep on the left and on the
+# right. The operands are constants, so the IR builder folds each expression to
+# a single value and the times are the front end's alone. Every run gets a
+# 1 MB stack, which a parser or codegen that recursed per nesting level would
+# overflow long before the largest size.
+#
+# Usage: bench/deep_expr.sh [path/to/main] [terms]
+
+MAIN=${1:-./main}
+TERMS=${2:-1000000}
+INPUT=${TMPDIR:-/tmp}/kaleidoscope_deep_bench.ks
+
+printf "%-6s %9s %10s %12s %10s %10s\n" shape terms "parse ms" "codegen ms" "ns/term" "peak RSS"
+for SHAPE in flat left right; do
+    for N in $((TERMS / 100)) $((TERMS / 10)) $TERMS; do
+        awk -v n=$N -v shape=$SHAPE 'BEGIN {
+            split("+ - * +", op, " ")
+            if (shape == "flat") {
+                printf "1"
+                for (i = 1; i < n; i++)
+                    printf " %s %d", op[i % 4 + 1], i % 10
+            } else if (shape == "left") {
+                # ((1 + 1) - 2) * 3 ...
+                for (i = 1; i < n; i++)
+                    printf "("
+                printf "1"
+                for (i = 1; i < n; i++)
+                    printf " %s %d)", op[i % 4 + 1], i % 10
+            } else {
+                # 1 + (1 - (2 * (3 ...)))
+                printf "1"
+                for (i = 1; i < n; i++)
+                    printf " %s (%d", op[i % 4 + 1], i % 10
+                for (i = 1; i < n; i++)
+                    printf ")"
+            }
+            print ";"
+        }' > "$INPUT"
+
+        START=$(date +%s%N)
+        STATS=$( (ulimit -s 1024; "$MAIN" -batch -phase-stats "$INPUT" 2>&1 >/dev/null) )
+        STATUS=$?
+        END=$(date +%s%N)
+        if [ $STATUS -ne 0 ]; then
+            printf "%-6s %9d failed with status %d\n" $SHAPE $N $STATUS
+            continue
+        fi
+        echo "$STATS" | awk -v shape=$SHAPE -v n=$N -v ns=$((END - START)) '
+            $1 == "parse" { parse = $3 }
+            $1 == "codegen" { codegen = $3 }
+            $1 == "Peak" { rss = $3 " " $4 }
+            END { printf "%-6s %9d %10.1f %12.1f %10.1f %10s\n", shape, n, parse, codegen, ns / n, rss }'
+    done
+done
+
+rm -f "$INPUT"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Startup latency with a large prelude, eager vs. -lazy.
+#
+# Generates a prelude of N helper definitions of which the script only calls
+# a handful, then times a -batch run with and without lazy compilation.
+#
+# Usage: bench/lazy_prelude.sh [path/to/main] [number of helpers]
+
+MAIN=${1:-./main}
+HELPERS=${2:-2000}
+INPUT=${TMPDIR:-/tmp}/kaleidoscope_prelude_bench.ks
+
+awk -v n=$HELPERS 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "def helper%d(x y) x * %d + y * (x - %d) + x * y * (x + %d) < (x - y) * (x + y);\n", i, i, i, i
+    print "helper0(1, 2) + helper1(3, 4) + helper2(5, 6);"
+}' > "$INPUT"
+
+for MODE in "" "-lazy"; do
+    echo "${MODE:-eager}:"
+    START=$(date +%s%N)
+    "$MAIN" -batch $MODE "$INPUT"
+    END=$(date +%s%N)
+    echo "  $(( (END - START) / 1000000 )) ms"
+done
+
+rm -f "$INPUT"
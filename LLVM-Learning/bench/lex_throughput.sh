@@ -0,0 +1,30 @@
+#!/bin/sh
+# Lexer throughput benchmark.
+#
+# Generates a multi-MB Kaleidoscope script and times `main -lex-only` over it,
+# once through the memory-mapped file path and once through buffered stdin.
+#
+# Usage: bench/lex_throughput.sh [path/to/main] [size in MB]
+
+MAIN=${1:-./main}
+SIZE_MB=${2:-16}
+INPUT=${TMPDIR:-/tmp}/kaleidoscope_lex_bench.ks
+
+awk -v target=$((SIZE_MB * 1024 * 1024)) 'BEGIN {
+    n = 0; bytes = 0
+    while (bytes < target) {
+        line = sprintf("def helper%d(alpha beta gamma) alpha * %d.25 + beta * (gamma - 3.5) < alpha + %d; # helper %d", n, n % 97, n, n)
+        print line
+        line2 = sprintf("helper%d(1, 2.5, %d) * helper%d(%d.5, 4, 0.125);", n, n, n, n % 13)
+        print line2
+        bytes += length(line) + length(line2) + 2
+        n++
+    }
+}' > "$INPUT"
+
+echo "file:"
+"$MAIN" -lex-only "$INPUT"
+echo "stdin:"
+"$MAIN" -lex-only < "$INPUT"
+
+rm -f "$INPUT"
@@ -0,0 +1,88 @@
+#!/bin/sh
+# Benchmark suite over the corpus in bench/corpus.
+#
+# Runs every workload RUNS times with -batch -phase-stats-json and reports the
+# median of each metric, so numbers from two commits can be compared directly:
+#
+#   parse MB/s   source bytes over time spent lexing and parsing
+#   compile us   codegen, addModule and lookup time per compiled function
+#                (lookup is where the JIT optimizes and compiles in -batch)
+#   first ms     compiler time until the first top-level expression returns
+#   exec us      mean run time of the top-level expressions after the first
+#   wall ms      whole process, including startup
+#
+# Extra arguments are passed through to main, e.g. -lazy or -O3.
+#
+# Usage: bench/run.sh [path/to/main] [runs] [main flags...]
+
+MAIN=${1:-./main}
+RUNS=${2:-5}
+[ $# -gt 2 ] && shift 2 || set --
+BENCH=$(dirname "$0")
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kaleidoscope_bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+cp "$BENCH"/corpus/*.ks "$WORK"
+sh "$BENCH/corpus/generate.sh" "$WORK"
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END {
+        if (NR == 0) print 0
+        else if (NR % 2) print v[(NR + 1) / 2]
+        else print (v[NR / 2] + v[NR / 2 + 1]) / 2
+    }'
+}
+
+# Pull the metrics for one run out of the -phase-stats-json output. Relies on
+# the one-attribute-per-line layout main writes.
+metrics() {
+    awk -v bytes="$2" -v wall="$3" '
+    /"phases"/   { section = "phases" }
+    /"per_item"/ { section = "items" }
+    section == "phases" && /: \{$/ { split($1, a, "\""); phase = a[2] }
+    section == "phases" && /"total_ns"/ { total[phase] = $2 + 0 }
+    section == "items" && /"kind"/ {
+        if (kind == "expr" && first == 0) first = cum
+        split($2, a, "\""); kind = a[2]
+        if (kind == "expr") exprs++
+        else if (kind == "def") defs++
+    }
+    section == "items" && /_ns"/ {
+        cum += $2
+        if (kind == "expr" && exprs > 1 && $1 ~ /execute_ns/) exec += $2
+    }
+    END {
+        if (kind == "expr" && first == 0) first = cum
+        lexparse = total["lex"] + total["parse"]
+        compile = total["codegen"] + total["addModule"] + total["lookup"]
+        fns = defs + exprs
+        printf("%.2f %.1f %.3f %.2f %d\n",
+            lexparse ? bytes / lexparse * 1e9 / 1048576 : 0,
+            fns ? compile / fns / 1e3 : 0,
+            first / 1e6,
+            exprs > 1 ? exec / (exprs - 1) / 1e3 : 0,
+            wall)
+    }' "$1"
+}
+
+printf "%-14s %10s %12s %12s %12s %12s\n" \
+    "workload" "parse MB/s" "compile us" "first ms" "exec us" "wall ms"
+for INPUT in "$WORK"/*.ks; do
+    NAME=$(basename "$INPUT" .ks)
+    BYTES=$(wc -c < "$INPUT")
+    : > "$WORK/$NAME.runs"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        START=$(date +%s%N)
+        "$MAIN" -batch -phase-stats-json="$WORK/$NAME.json" "$@" "$INPUT" > /dev/null 2>&1
+        END=$(date +%s%N)
+        metrics "$WORK/$NAME.json" "$BYTES" $(( (END - START) / 1000000 )) >> "$WORK/$NAME.runs"
+        i=$((i + 1))
+    done
+    printf "%-14s" "$NAME"
+    for COL in 1 2 3 4 5; do
+        printf " %12s" "$(cut -d' ' -f$COL "$WORK/$NAME.runs" | median)"
+    done
+    printf "\n"
+done
@@ -0,0 +1,100 @@
+//===- two_sessions.cpp - Two Kaleidoscope sessions on two threads --------===//
+//
+// Embeds the compiler twice. Each thread creates a Session with settings of
+// its own, binds a host array, defines functions named like the other
+// thread's but with different bodies, and calls them over and over, while the
+// other thread does the same. Exits non-zero if a session sees anything of
+// the other one.
+//
+// Build from the LLVM-Learning directory:
+//   clang++ -O2 -I. examples/two_sessions.cpp Session.cpp `llvm-config
+//     --cxxflags --ldflags --system-libs --libs all` -rdynamic -o two_sessions
+//
+//===----------------------------------------------------------------------===//
+
+#include "Session.h"
+#include "llvm/Support/Error.h"
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+struct Worker {
+    const char* Name;
+    SessionOptions Opts;
+    double Factor;
+    std::string Failure; // Empty if every check passed
+};
+
+static void Run(Worker& W) {
+    auto Fail = [&](const std::string& Msg) {
+        if (W.Failure.empty())
+            W.Failure = Msg;
+    };
+    auto Sess = Session::Create(W.Opts);
+    if (!Sess)
+        return Fail(toString(Sess.takeError()));
+
+    std::vector<double> Data(1000);
+    for (size_t I = 0; I < Data.size(); ++I)
+        Data[I] = I;
+    if (auto Err = (*Sess)->bindArray("data", Data.data(), Data.size()))
+        return Fail(toString(std::move(Err)));
+
+    std::string Source =
+        "def scale(x) x * " + std::to_string(W.Factor) + ";\n"
+        "def total(n) var s = 0 in (for i = 0, i < n in s = s + scale(data[i])) : s;\n";
+    if (!(*Sess)->compile(Source))
+        return Fail("compile failed");
+
+    const double Expected = W.Factor * 999 * 1000 / 2;
+    for (unsigned Round = 0; Round < 200; ++Round) {
+        auto Total = (*Sess)->call("total", { 1000.0 });
+        if (!Total)
+            return Fail(toString(Total.takeError()));
+        if (*Total != Expected)
+            return Fail("total(1000) = " + std::to_string(*Total) + ", expected " +
+                std::to_string(Expected));
+    }
+
+    std::vector<double> Column(Data), Out(Data.size());
+    const double* Columns[] = { Column.data() };
+    if (!(*Sess)->evaluateBatch("scale", Columns, Out.data(), Out.size()))
+        return Fail("evaluateBatch failed");
+    for (size_t I = 0; I < Out.size(); ++I)
+        if (Out[I] != W.Factor * I)
+            return Fail("scale(" + std::to_string(I) + ") = " + std::to_string(Out[I]));
+}
+
+int main() {
+    // Different settings, which must stay with their own session
+    SessionOptions Eager;
+    Eager.Batch = true;
+    Eager.OptLevel = 3;
+    Eager.FastMath = true;
+    Eager.ExprCacheSize = 0;
+    SessionOptions Profiled;
+    Profiled.Batch = true;
+    Profiled.OptLevel = 1;
+    Profiled.PGOThreshold = 50;
+    Profiled.InlineImportLimit = 0;
+    Profiled.MemoSize = 0;
+    Profiled.MapThreads = 2;
+
+    Worker Workers[] = { { "eager", Eager, 2, "" }, { "profiled", Profiled, 3, "" } };
+    std::vector<std::thread> Threads;
+    for (auto& W : Workers)
+        Threads.emplace_back(Run, std::ref(W));
+    for (auto& T : Threads)
+        T.join();
+
+    int RC = 0;
+    for (auto& W : Workers) {
+        printf("%s: %s\n", W.Name, W.Failure.empty() ? "ok" : W.Failure.c_str());
+        RC |= !W.Failure.empty();
+    }
+    return RC;
+}
@@ -1,692 +1,165 @@
-
-#include "/usr/share/doc/llvm-14-examples/examples/Kaleidoscope/include/KaleidoscopeJIT.h"
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Verifier.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include <algorithm>
-#include <cassert>
-#include <cctype>
+#include "Session.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
-#include <cstdlib>
-#include <map>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 using namespace llvm;
-using namespace llvm::orc;
-
-//===----------------------------------------------------------------------===//
-// Lexer
-//===----------------------------------------------------------------------===//
-
-enum Token {
-    tok_eof = -1,
-
-    // commands
-    tok_def = -2,
-    tok_extern = -3,
-
-    // primary
-    tok_identifier = -4,
-    tok_number = -5
-};
-
-// Metadata for tokens
-static std::string IdentifierStr; 
-static double NumVal;             
-
-static int gettok() {
-    // Retains value between function calls
-    static int LastChar = ' ';
-
-    // Skip any whitespace.
-    while (isspace(LastChar)) LastChar = getchar();
-
-    // Might be keyword or identifier
-    if (isalpha(LastChar)) { 
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
-
-        // Check if keyword
-        if (IdentifierStr == "def")
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-
-        // Not a keyword, must be user-defined identifier
-        return tok_identifier;
-    }
-
-    // Is a number - EXTEND to avoid [0-9.]+
-    if (isdigit(LastChar) || LastChar == '.') { 
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
-    }
-
-    // Is comment
-    if (LastChar == '#') {
-        
-        do {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        // Newline encountered, recursively scan for more tokens
-        if (LastChar != EOF)
-            return gettok();
-    }
-
-    if (LastChar == EOF)
-        return tok_eof;
 
-    // Return current char as its ASCII value 
-    // Update 'LastChar' due to it's static nature - next call to gettok() works with updated value
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
-}
-
-//===----------------------------------------------------------------------===//
-// Abstract Syntax Tree (aka Parse Tree)
-//===----------------------------------------------------------------------===//
-
-namespace {
-
-    class ExprAST {
-    public:
-        virtual ~ExprAST() = default;
-
-        virtual Value* codegen() = 0;
-    };
-
-    class NumberExprAST : public ExprAST {
-        double Val;
-    public:
-        NumberExprAST(double Val) : Val(Val) {}
-
-        Value* codegen() override;
-    };
-
-    class VariableExprAST : public ExprAST {
-        std::string Name;
-    public:
-        VariableExprAST(const std::string& Name) : Name(Name) {}
-
-        Value* codegen() override;
-    };
-
-    class BinaryExprAST : public ExprAST {
-        char Op;
-        std::unique_ptr<ExprAST> LHS, RHS;
-    public:
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-            std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-
-        Value* codegen() override;
-    };
-
-    // Function Calling
-    class CallExprAST : public ExprAST {
-        std::string Callee; // Function Name
-        std::vector<std::unique_ptr<ExprAST>> Args; // Arg types not stored since every Value is assumed to be a DP FP number 
-    public:
-        CallExprAST(const std::string& Callee,
-            std::vector<std::unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
-
-        // Not calling Function* here because a call expression produces a value and not a functions
-        Value* codegen() override;
-    };
-
-    // Function Declaration
-    class PrototypeAST {
-        std::string Name;
-        std::vector<std::string> Args;
-    public:
-        PrototypeAST(const std::string& Name, std::vector<std::string> Args)
-            : Name(Name), Args(std::move(Args)) {}
-
-        Function* codegen();
-        const std::string& getName() const { return Name; }
-    };
-
-    // Function Definition
-    class FunctionAST {
-        std::unique_ptr<PrototypeAST> Proto;
-        std::unique_ptr<ExprAST> Body;
-    public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
-        
-        Function* codegen();
-    };
-} 
-
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
-
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-static std::map<char, int> BinopPrecedence;
-
-static int GetTokPrecedence() {
-    // Operator tokens are ASCII values
-    if (!isascii(CurTok)) return -1;
-
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
-        return -1;
-    return TokPrec;
-}
-
-std::unique_ptr<ExprAST> LogError(const char* Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-}
-
-std::unique_ptr<PrototypeAST> LogErrorP(const char* Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // consume number
-    return std::move(Result);
-}
-
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken(); // consume '(' 
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
-
-    if (CurTok != ')') return LogError("expected ')'");
-    getNextToken(); // consume ')'
-    return V;
-}
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
-
-    getNextToken(); 
-
-    // Just a variable and not a call expression
-    if (CurTok != '(') 
-        return std::make_unique<VariableExprAST>(IdName);
-
-    getNextToken(); // consume '(' 
-
-    // Parse args of call expression
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if (CurTok == ')')
-                break;
-
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
-    }
-
-    getNextToken(); // consume ')'
-
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
-
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    // CurTok allows for lookahead
-    switch (CurTok) {
-    default:
-        return LogError("unknown token when expecting an expression");
-    case tok_identifier:
-        return ParseIdentifierExpr();
-    case tok_number:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
-    }
-}
-
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
-    while (true) {
-        int TokPrec = GetTokPrecedence();
-
-        // Current operator does not have a high precedence than the previous one
-        if (TokPrec < ExprPrec)
-            return LHS;
-
-        int BinOp = CurTok;
-        getNextToken(); // consume the operator
-
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
-
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
-        }
-
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    }
-}
-
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    if (CurTok != tok_identifier)
-        return LogErrorP("Expected function name in prototype");
-
-    std::string FnName = IdentifierStr;
-    getNextToken(); // consume identifier
-
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
-
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
-    if (CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
-
-    getNextToken(); // consume ')'
-
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
-}
-
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-    getNextToken(); // consume 'def'
-    auto Proto = ParsePrototype();
-    if (!Proto)
-        return nullptr;
-
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
-}
-
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // Make an anonymous proto (no args)
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-            std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    }
-    return nullptr;
-}
-
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken(); // eat extern
-    return ParsePrototype();
-}
-
-//===----------------------------------------------------------------------===//
-// Code Generation
-//===----------------------------------------------------------------------===//
-
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value*> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 static ExitOnError ExitOnErr;
 
-Function* getFunction(std::string Name) {
-    
-    // First check if the function has already been added to the current module
-    if (auto* F = TheModule->getFunction(Name)) return F;
-
-    // If not, check whether we can codegen the declaration from some existing prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
-
-    // If no existing prototype exists, return null.
-    return nullptr;
-}
-
-Value* LogErrorV(const char* Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-Value* NumberExprAST::codegen() {
-    // We use get:: to avoid having different variables point to identical valued constants
-    // More memory efficient to have a single variable and reuse that
-    return ConstantFP::get(*TheContext, APFloat(Val));
-}
-
-// Variable Reference
-Value* VariableExprAST::codegen() {
-    // Look this variable up in the function.
-    Value* V = NamedValues[Name];
-    if (!V)
-        return LogErrorV("Unknown variable name");
-    return V;
-}
-
-Value* BinaryExprAST::codegen() {
-    Value* L = LHS->codegen();
-    Value* R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
-
-    switch (Op) {
-    case '+':
-        return Builder->CreateFAdd(L, R, "addtmp");
-    case '-':
-        return Builder->CreateFSub(L, R, "subtmp");
-    case '*':
-        return Builder->CreateFMul(L, R, "multmp");
-    case '<':
-        L = Builder->CreateFCmpULT(L, R, "cmptmp");
-        // Convert bool 0/1 to double 0.0 or 1.0
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    default:
-        return LogErrorV("invalid binary operator");
-    }
-}
-
-Value* CallExprAST::codegen() {
-    // Look up the name in the Module's symbol table
-    Function* CalleeF = getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
-
-    // CalleeF is the callee's function definition
-    // The Args refer to the the arguments passed in when a call to CalleeF is made
-    // Args.size() depends on user input for calling, CalleeF depends on the function definition
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
-
-    // Codegen'ing call arguments
-    std::vector<Value*> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
-            return nullptr;
-    }
-
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
-
-// Declare Function Signature
-Function* PrototypeAST::codegen() {
-    // Create a vector of Type pointers for function arguments, all of type double
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    
-    // Create a FunctionType representing a function returning double and taking
-    // arguments of double types based on the vector created above
-    FunctionType* FT = 
-        FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-
-    // Create a new Function instance with ExternalLinkage, the given name, and
-    // associated with the current module (TheModule)
-    // Implicitly generated IR for function args
-    // .get() retrives the raw pointer from TheModule to pass into the function
-    // The name is registered in TheModule's symbol tables
-    Function* F =
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-
-    // Set names (parameter names) for function arguments based on the names provided in the Args vector
-    unsigned Idx = 0;
-    for (auto& Arg : F->args())
-        Arg.setName(Args[Idx++]);
-
-    // Return the generated LLVM function instance
-    // Function signitures in LLVM = functions but functions without bodies
-    return F;
-}
-
-Function* FunctionAST::codegen() {
-
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
-    auto& P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    Function* TheFunction = getFunction(P.getName());
-    if (!TheFunction)
-        return nullptr;
-
-    // Create a basic block named 'entry' in the function
-    BasicBlock* BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    
-    // Set the insertion point for the IRBuilder to the new basic block 'entry'
-    Builder->SetInsertPoint(BB);
-
-    // Clear the map of NamedValues in the current scope (NamedValues could hold another function's values)
-    NamedValues.clear();
-
-    // Adding function parameters into the NamedValues map so that they can be resolved within the function body
-    // Their value in the map is an address that comes from the LLVM function's arg list. 
-    // The LLVM function's arg list is updated with the values of the codegen'd arguments when it is called 
-    // Since we passed an address to NamedValues, the above change is reflected within the map
-    for (auto& Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
-    
-    // Generate code for the body of the function
-    if (Value* RetVal = Body->codegen()) {
-        // If the body code generation is successful, create a return instruction
-        Builder->CreateRet(RetVal);
-
-        // Verify the function to ensure it is well-formed
-        verifyFunction(*TheFunction);
-
-        // Optimize the function
-        TheFPM->run(*TheFunction);
-
-        // Return the generated function
-        return TheFunction;
-    }
-
-    // If the body code generation is unsuccessful, erase the function and return nullptr
-    // If we didnt delete it, it would live in the symbol table, with a body, preventing future redefinition.
-    TheFunction->eraseFromParent();
-    return nullptr;
-}
-
 //===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
+// Main driver code.
 //===----------------------------------------------------------------------===//
 
-static void InitializeModuleAndPassManager() {
-    // Open a new context and module.
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());
+static cl::opt<std::string> InputFilename(cl::Positional,
+    cl::desc("<input file>"), cl::init("-"));
 
-    // Create a new builder for the module.
-    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+static cl::opt<bool> LexOnly("lex-only",
+    cl::desc("Only tokenize the input and report lexer throughput"));
 
-    // Create a new pass manager attached to it.
-    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+static cl::opt<std::string> OutputFilename("o",
+    cl::desc("Compile ahead of time to this object file (or executable with "
+             "-link) instead of running the input"),
+    cl::value_desc("filename"));
 
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    TheFPM->add(createInstructionCombiningPass());
-    // Reassociate expressions.
-    TheFPM->add(createReassociatePass());
-    // Eliminate Common SubExpressions.
-    TheFPM->add(createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->add(createCFGSimplificationPass());
+static cl::opt<bool> LinkExecutable("link",
+    cl::desc("With -o, link a standalone executable including the "
+             "putchard/printd runtime"));
 
-    TheFPM->doInitialization();
-}
+static cl::list<std::string> ArrayOptions("array",
+    cl::desc("Bind a host array: NAME=FILE maps a file of doubles (stores stay "
+             "private to the run), NAME:N allocates N zeroed doubles"),
+    cl::value_desc("name=file|name:n"));
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto* FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            ExitOnErr(TheJIT->addModule(
-                ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-            InitializeModuleAndPassManager();
-        }
-    }
-    else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
+// Memory behind the -array bindings, which must outlive the code using it
+struct ArrayStorage {
+    std::vector<std::unique_ptr<sys::fs::mapped_file_region>> Mappings;
+    std::vector<std::unique_ptr<double[]>> Buffers;
+};
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (auto* FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+// Map a file of native-endian doubles copy-on-write, so reading it costs no
+// copy and stores into it don't reach the file.
+static bool MapArrayFile(StringRef Path, ArrayStorage& Storage, double*& Data,
+    uint64_t& Size) {
+    uint64_t Bytes;
+    if (auto EC = sys::fs::file_size(Path, Bytes)) {
+        fprintf(stderr, "Error: cannot read '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+        return false;
+    }
+    if (Bytes % sizeof(double)) {
+        fprintf(stderr, "Error: '%s' does not hold a whole number of doubles\n",
+            Path.str().c_str());
+        return false;
+    }
+    Data = nullptr;
+    Size = Bytes / sizeof(double);
+    if (!Bytes)
+        return true;
+
+    auto File = sys::fs::openNativeFileForRead(Path);
+    if (!File) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", Path.str().c_str(),
+            toString(File.takeError()).c_str());
+        return false;
+    }
+    std::error_code EC;
+    auto Region = std::make_unique<sys::fs::mapped_file_region>(*File,
+        sys::fs::mapped_file_region::priv, Bytes, 0, EC);
+    sys::fs::closeFile(*File);
+    if (EC) {
+        fprintf(stderr, "Error: cannot map '%s': %s\n", Path.str().c_str(),
+            EC.message().c_str());
+        return false;
+    }
+    Data = (double*)Region->data();
+    Storage.Mappings.push_back(std::move(Region));
+    return true;
+}
+
+static bool BindArrayOptions(Session& Sess, ArrayStorage& Storage) {
+    for (StringRef Option : ArrayOptions) {
+        StringRef Name, Arg;
+        double* Data;
+        uint64_t Size;
+        if (Option.contains('=')) {
+            std::tie(Name, Arg) = Option.split('=');
+            if (!MapArrayFile(Arg, Storage, Data, Size))
+                return false;
         }
-    }
-    else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
-
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an annonymous function
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (FnAST->codegen()) {
-            
-            // Create a ResourceTracker to track JIT'd memory allocated to our
-            // anonymous expression -- that way we can free it after executing.
-            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModuleAndPassManager(); 
-            
-            // Search the JIT for the __anon_expr symbol
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-            fprintf(stderr, "Evaluated to %f\n", FP());
-
-            // Delete the anonymous expression module from the JIT 
-            ExitOnErr(RT->remove());
+        else {
+            std::tie(Name, Arg) = Option.split(':');
+            if (Arg.getAsInteger(10, Size)) {
+                fprintf(stderr, "Error: -array expects NAME=FILE or NAME:N\n");
+                return false;
+            }
+            Storage.Buffers.emplace_back(new double[Size]());
+            Data = Storage.Buffers.back().get();
         }
-    }
-    else {
-        getNextToken();
-    }
-}
-
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
-        case tok_eof:
-            return;
-        case ';': 
-            getNextToken();
-            break;
-        case tok_def:
-            HandleDefinition();
-            break;
-        case tok_extern:
-            HandleExtern();
-            break;
-        default:
-            HandleTopLevelExpression();
-            break;
+        if (auto Err = Sess.bindArray(Name, Data, Size)) {
+            fprintf(stderr, "Error: %s\n", toString(std::move(Err)).c_str());
+            return false;
         }
     }
+    return true;
 }
 
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
-
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
-    return 0;
-}
+// Drain the lexer without parsing; used by bench/lex_throughput.sh.
+static int RunLexOnly(Session& Sess) {
+    auto Start = std::chrono::steady_clock::now();
+    uint64_t NumTokens = Sess.lexOnly();
+    std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
+    double MB = Sess.Src.BytesRead / (1024.0 * 1024.0);
+    fprintf(stderr, "Lexed %llu tokens from %.2f MB in %.3f s (%.1f MB/s)\n",
+        (unsigned long long)NumTokens, MB, Elapsed.count(),
+        Elapsed.count() > 0 ? MB / Elapsed.count() : 0.0);
     return 0;
 }
 
-//===----------------------------------------------------------------------===//
-// Main driver code.
-//===----------------------------------------------------------------------===//
+int main(int argc, char** argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
 
-int main() {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+    Session Sess(SessionOptions::fromCommandLine());
+    if (!Sess.Src.open(InputFilename))
+        return 1;
+    if (LexOnly)
+        return RunLexOnly(Sess);
 
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40; 
+    if (!OutputFilename.empty()) {
+        if (!ArrayOptions.empty()) {
+            fprintf(stderr, "Error: -array needs the JIT\n");
+            return 1;
+        }
+        bool Ok = Sess.compileToFile(OutputFilename, LinkExecutable);
+        Sess.reportStats();
+        return Ok ? 0 : 1;
+    }
 
-    fprintf(stderr, "ready> ");
-    getNextToken();
+    ExitOnErr(Sess.initializeJIT());
+    ArrayStorage Arrays;
+    if (!BindArrayOptions(Sess, Arrays))
+        return 1;
 
-    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    Sess.run();
 
-    InitializeModuleAndPassManager();
+    if (!Sess.Opts.Batch)
+        Sess.TheModule->print(errs(), nullptr);
 
-    MainLoop();
+    if (auto* Cache = Sess.TheJIT->getObjectCache())
+        fprintf(stderr, "Object cache: %u hits, %u misses\n",
+            Cache->getHits(), Cache->getMisses());
 
-    TheModule->print(errs(), nullptr);
+    Sess.reportStats();
 
     return 0;
 }